@@ -7,23 +7,45 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <locale.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include <malloc.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <iostream>
 #include <iomanip>
+#include <iterator>
+#include <chrono>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <string>
 #include <map>
+#include <deque>
+#include <unordered_map>
+#include <set>
+#include <unordered_set>
+#include <algorithm>
+#include <tuple>
 
 #include <functional>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 using namespace std;
 class app;
@@ -34,6 +56,9 @@ class logger {
 private:
   // static instance of logger.
   static logger* debug_logger;
+  // lines logged before the log file was opened.
+  string held;
+  bool opened = false;
 public:
   log_level level;
   ofstream debug_stream;
@@ -44,10 +69,56 @@ public:
     //    if(logger::debug_mode)
     //      this->debug_stream.close();
   }
+  void open();
   ostream& out();
   logger& log(const string& str);
 };
 
+/**
+ * When each phase of startup ended, in ms since the process started.
+ * Printed to stderr on exit with --trace-startup.
+ */
+class startup_trace {
+  static chrono::steady_clock::time_point begin;
+  static vector<pair<string,double>> phases;
+
+public:
+  static bool enabled;
+
+  static double now() {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+  }
+
+  static void mark(const string& phase) {
+    phases.push_back(make_pair(phase, now()));
+  }
+
+  /**
+   * End of phase, 0 when it did not happen.
+   */
+  static double at(const string& phase) {
+    for(auto& p : phases) {
+      if(p.first == phase) {
+        return p.second;
+      }
+    }
+    return 0;
+  }
+
+  static void print(ostream& out) {
+    double last = 0;
+    for(auto& p : phases) {
+      out<<fixed<<setprecision(2)<<setw(9)<<p.second<<" ms  +"
+         <<setw(8)<<(p.second - last)<<"  "<<p.first<<"\n";
+      last = p.second;
+    }
+  }
+};
+
+chrono::steady_clock::time_point startup_trace::begin = chrono::steady_clock::now();
+vector<pair<string,double>> startup_trace::phases;
+bool startup_trace::enabled = false;
+
 class app {
   friend class logger;
 public:
@@ -55,6 +126,10 @@ public:
   static string debug_log_file;
   static logger* debug_logger;
   static logger& get_logger();
+  static size_t undo_limit;  // bytes of undo history per buffer
+  static bool headless;      // no terminal: no highlighting, no journal
+  static bool sync_saves;    // fsync each save, off when the caller syncs
+  static size_t index_limit; // bytes all trigram indexes may take
 
   app() {
     if(!debug_logger) {
@@ -64,8 +139,12 @@ public:
   }
 
   ~app() {
+    debug_logger->open();
     debug_logger->log("x:ended");
     delete &(app::get_logger()); // close log file
+    if(startup_trace::enabled) {
+      startup_trace::print(cerr);
+    }
   }
 };
 
@@ -75,16 +154,33 @@ bool app::debug_mode = true;
 bool app::debug_mode = true;
 #endif
 string app::debug_log_file = "x-debug.log";
+size_t app::undo_limit = 64 << 20;
+bool app::headless = false;
+bool app::sync_saves = true;
+size_t app::index_limit = 256 << 20;
 
 const char* log_file ="x.log";
 
 logger::logger() : level(LOG_LEVEL_INFO) {
-  this->debug_stream.open(app::debug_log_file,
-			  std::ofstream::out);
   if(app::debug_mode) {
     this->level = LOG_LEVEL_DEBUG;
   }
+}
+
+/**
+ * Create the log file, put off until the editor is up.
+ */
+void logger::open() {
+  if(this->opened) {
+    return;
+  }
+  this->opened = true;
+  this->debug_stream.open(app::debug_log_file,
+			  std::ofstream::out);
   this->debug_stream<<"*start*:x logger"<<endl;
+  this->debug_stream<<this->held;
+  this->debug_stream.flush();
+  this->held.clear();
 }
 
 ostream& logger::out(){
@@ -92,11 +188,13 @@ ostream& logger::out(){
 }
 
 logger& logger::log(const string& str) {
-  ostream &log = out();
-  if(app::debug_mode) {
+  if(app::debug_mode && !this->opened) {
+    this->held += str + "\n";
+  } else if(app::debug_mode) {
+    ostream &log = out();
     log<<str<<endl;
+    log.flush();
   }
-  log.flush();
   return *this;
 }
 
@@ -110,39 +208,276 @@ logger& app::get_logger() {
 }
 
 
+/**
+ * Monotonic arena: memory is handed out from large blocks by bumping a
+ * pointer and is never freed piecemeal. Everything goes away at once
+ * in release(), which is how a buffer drops millions of lines.
+ */
+class line_arena {
+private:
+  const static size_t default_block_size = 1 << 20;
+
+  vector<char*> blocks;
+  char*  cur  = nullptr;
+  size_t left = 0;
+  size_t block_size;
+  size_t used = 0;
+  size_t reserved = 0;  // blocks come in block_size or bigger
+
+  static size_t padding(const char* p, size_t align) {
+    return (align - (reinterpret_cast<uintptr_t>(p) & (align - 1))) & (align - 1);
+  }
+
+public:
+  line_arena(size_t bs = default_block_size): block_size(bs) {}
+
+  line_arena(const line_arena&) = delete;
+  line_arena& operator=(const line_arena&) = delete;
+
+  void* allocate(size_t n, size_t align = alignof(max_align_t)) {
+    size_t pad = padding(cur, align);
+
+    if(!cur || pad + n > left) {  // never nullptr, not even for n == 0
+      if(n + align > block_size) { // oversized: give it a block of its own
+        char* big = new char[n + align];
+        blocks.push_back(big);
+        used += n;
+        reserved += n + align;
+        return big + padding(big, align);
+      }
+      cur  = new char[block_size];
+      left = block_size;
+      blocks.push_back(cur);
+      reserved += block_size;
+      pad  = padding(cur, align);
+    }
+
+    char* p = cur + pad;
+    cur  += pad + n;
+    left -= pad + n;
+    used += n;
+    return p;
+  }
+
+  template<typename T, typename... Args>
+  T* make(Args&&... args) {
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  char* copy(const char* data, size_t n) {
+    char* p = static_cast<char*>(allocate(n, 1));
+    memcpy(p, data, n);
+    return p;
+  }
+
+  size_t bytes_used() {
+    return used;
+  }
+
+  size_t bytes_reserved() {
+    return reserved;
+  }
+
+  /**
+   * Take over the blocks of other, what lives there now lives as long
+   * as this arena does.
+   */
+  void adopt(line_arena& other) {
+    blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+    used += other.used;
+    reserved += other.reserved;
+    other.blocks.clear();
+    other.cur  = nullptr;
+    other.left = 0;
+    other.used = 0;
+    other.reserved = 0;
+  }
+
+  /**
+   * Free every block, objects living in the arena are not destructed.
+   */
+  void release() {
+    for(auto b : blocks) {
+      delete[] b;
+    }
+    blocks.clear();
+    cur  = nullptr;
+    left = 0;
+    used = 0;
+    reserved = 0;
+  }
+
+  ~line_arena() {
+    release();
+  }
+};
+
+/**
+ * Size-class pool for gap buffer storage. Chunks are powers of two
+ * between 2^min_shift and 2^max_shift, carved from a slab arena and
+ * recycled through per-class free lists. Bigger chunks go to the heap.
+ */
+class gap_pool {
+private:
+  const static int min_shift = 4;   // 16 bytes
+  const static int max_shift = 16;  // 64k
+  const static size_t slab_size = 1 << 18;
+
+  line_arena slabs;
+  vector<char*> free_lists[max_shift - min_shift + 1];
+  set<char*> large;
+
+  static int size_class(size_t n) {
+    int shift = min_shift;
+    while((size_t(1) << shift) < n) {
+      shift++;
+    }
+    return shift - min_shift;
+  }
+
+public:
+  gap_pool(): slabs(slab_size) {}
+
+  gap_pool(const gap_pool&) = delete;
+  gap_pool& operator=(const gap_pool&) = delete;
+
+  /**
+   * Round request up to the chunk size actually handed out.
+   */
+  static size_t chunk_size(size_t n) {
+    if(n > (size_t(1) << max_shift)) {
+      return n;
+    }
+    return size_t(1) << (size_class(n) + min_shift);
+  }
+
+  char* allocate(size_t n) {
+    n = chunk_size(n);
+    if(n > (size_t(1) << max_shift)) {
+      char* p = new char[n];
+      large.insert(p);
+      return p;
+    }
+
+    vector<char*>& free_list = free_lists[size_class(n)];
+    if(!free_list.empty()) {
+      char* p = free_list.back();
+      free_list.pop_back();
+      return p;
+    }
+    return static_cast<char*>(slabs.allocate(n, 1 << min_shift));
+  }
+
+  void deallocate(char* p, size_t n) {
+    if(!p) {
+      return;
+    }
+    n = chunk_size(n);
+    if(n > (size_t(1) << max_shift)) {
+      large.erase(p);
+      delete[] p;
+      return;
+    }
+    free_lists[size_class(n)].push_back(p);
+  }
+
+  /**
+   * Drop every chunk handed out so far.
+   */
+  void release() {
+    for(auto p : large) {
+      delete[] p;
+    }
+    large.clear();
+    for(auto& free_list : free_lists) {
+      free_list.clear();
+    }
+    slabs.release();
+  }
+
+  ~gap_pool() {
+    release();
+  }
+};
+
 // reference:  http://scienceblogs.com/goodmath/2009/02/18/gap-buffer
 
 class gap_line {
 private:
-  const static int default_gap_size = 2;  // 1024
-  int size = 0;
-  int gap_start  = 0;      //exclude gap_start
-  int gap_end = 0;     //exclude gap_end
-  char* buf;
-  int gap_size  = default_gap_size;
+  const static int default_gap_size = 16;
+
+  gap_pool* pool;
+  char* buf      = nullptr;
+  int size       = 0;  // capacity of buf
+  int gap_start  = 0;  // first byte of the gap
+  int gap_end    = 0;  // first byte after the gap
 
 public:
 
-  gap_line(int gap_size = default_gap_size): gap_size(default_gap_size) {
-    buf = new char[gap_size];
-    gap_start = 0;
-    gap_end = 0;
-    size = gap_size;
+  gap_line(const gap_line&) = delete;
+  gap_line& operator=(const gap_line&) = delete;
+
+  gap_line(gap_pool& p, const char* data, int len,
+           int gap_size = default_gap_size): pool(&p) {
+    size = gap_pool::chunk_size(len + gap_size);
+    buf  = pool->allocate(size);
+    memcpy(buf, data, len);
+    gap_start = len;
+    gap_end   = size;
+  }
+
+  int length() const {
+    return size - (gap_end - gap_start);
   }
 
-  gap_line(const string& data,int gap_size = default_gap_size): gap_line() {
-    for(auto it = data.begin() ; it != data.end() ; it++) {
-      insert_char('a');
+  /**
+   * Move the gap so that it starts at text offset pos.
+   */
+  void move_gap(int pos) {
+    if(pos < gap_start) {
+      int n = gap_start - pos;
+      memmove(buf + gap_end - n, buf + pos, n);
+      gap_start -= n;
+      gap_end   -= n;
+    } else if(pos > gap_start) {
+      int n = pos - gap_start;
+      memmove(buf + gap_start, buf + gap_end, n);
+      gap_start += n;
+      gap_end   += n;
     }
   }
 
   void insert_char(char c) {
-    if(gap_start + gap_end == size) {
-      expand();
+    if(gap_start == gap_end) {
+      expand(1);
+    }
+    buf[gap_start++] = c;
+  }
+
+  void insert(int pos, const char* data, int n) {
+    move_gap(pos);
+    if(gap_end - gap_start < n) {
+      expand(n);
     }
+    memcpy(buf + gap_start, data, n);
+    gap_start += n;
+  }
+
+  void erase(int pos, int n) {
+    move_gap(pos);
+    gap_end = min(gap_end + n, size);
+  }
+
+  /**
+   * Contiguous view of the text, parks the gap at the end.
+   */
+  const char* contents() {
+    move_gap(length());
+    return buf;
+  }
 
-    //buf[gap_start] = c;
-    gap_start = gap_start + 1;
+  string str() const {
+    return string(buf, gap_start) + string(buf + gap_end, size - gap_end);
   }
 
   string gap_info()  {
@@ -158,754 +493,6740 @@ public:
   }
 
   /**
-   * Double the size of the buffer, everytime our gaps meet
+   * Grow into the next size class, everytime our gaps meet
    */
-  void expand() {
+  void expand(int need) {
+    int new_size = gap_pool::chunk_size(max(2 * size, length() + need));
+    char* new_buffer = pool->allocate(new_size);
+    int tail = size - gap_end;
 
-    int new_size  = (size == 0) ?  1: 2 * size;
-    char* new_buffer = new char[new_size];
+    memcpy(new_buffer, buf, gap_start);
+    memcpy(new_buffer + new_size - tail, buf + gap_end, tail);
 
-    /**
-     * Fill till we hit gap_start.
-     */
-    int i = 0;
-    while(i < gap_start) {
-      new_buffer[i] = buf[i];
-      i++;
+    pool->deallocate(buf, size);
+
+    this->buf     = new_buffer;
+    this->gap_end = new_size - tail;
+    this->size    = new_size;
+  }
+
+  ~gap_line() {
+    pool->deallocate(buf, size);
+  }
+
+};
+
+
+/**
+ * UTF-8 helpers. Lines are scanned for the first non-ASCII byte sixteen
+ * bytes at a time, so plain ASCII text is classified at memory speed and
+ * never decoded.
+ */
+class utf8 {
+public:
+  const static uint32_t bad = 0x110000;  // invalid byte, shown as '?'
+
+  struct range {
+    uint32_t first;
+    uint32_t last;
+  };
+
+  /**
+   * Offset of the first byte with the high bit set, len if none.
+   */
+  static size_t ascii_prefix(const char* text, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= len ; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+      int mask = _mm_movemask_epi8(v);
+      if(mask) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    for(; i < len ; i++) {
+      if(text[i] & 0x80) {
+        return i;
+      }
     }
+    return len;
+  }
 
-    /**
-     * From the end of the new array keep filling in you have
-     * reached gap_end
-     */
-    int j = 0;
-    while(j < gap_end) {
-      new_buffer[new_size -1 + j] = buf[size - 1 + j];
-      j++;
+  /**
+   * Length of the well formed sequence at p, 0 when it is not one.
+   */
+  static int sequence_length(const unsigned char* p, size_t left) {
+    unsigned char c = p[0];
+    int n;
+    if(c < 0x80) {
+      return 1;
+    } else if(c < 0xC2) {
+      return 0;
+    } else if(c < 0xE0) {
+      n = 2;
+    } else if(c < 0xF0) {
+      n = 3;
+    } else if(c < 0xF5) {
+      n = 4;
+    } else {
+      return 0;
     }
 
-    // Update gap_end to reflect one character past the gap
-    this->gap_end = (new_size  - 1) - gap_end; // old gap end
+    if(left < size_t(n)) {
+      return 0;
+    }
+    for(int i = 1 ; i < n ; i++) {
+      if((p[i] & 0xC0) != 0x80) {
+        return 0;
+      }
+    }
+    // overlong forms, surrogates and code points past U+10FFFF
+    if((c == 0xE0 && p[1] < 0xA0) || (c == 0xED && p[1] > 0x9F) ||
+       (c == 0xF0 && p[1] < 0x90) || (c == 0xF4 && p[1] > 0x8F)) {
+      return 0;
+    }
+    return n;
+  }
 
-    //delete buf; // free previous
+  static bool validate(const char* text, size_t len) {
+    size_t i = 0;
+    while(true) {
+      i += ascii_prefix(text + i, len - i);
+      if(i == len) {
+        return true;
+      }
+      int n = sequence_length(reinterpret_cast<const unsigned char*>(text + i), len - i);
+      if(!n) {
+        return false;
+      }
+      i += n;
+    }
+  }
 
-    this->buf = new_buffer; // assign new buffer
-    this->size = new_size;  //  why is size not getting updated ?
+  /**
+   * Decode the code point at byte, returns the bytes it takes. Text
+   * known to be valid skips the checks.
+   */
+  static int decode(const char* text, int len, int byte, uint32_t& cp, bool valid) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text + byte);
+    int n;
+    if(p[0] < 0x80) {
+      cp = p[0];
+      return 1;
+    }
+    if(valid) {
+      n = p[0] < 0xE0 ? 2 : p[0] < 0xF0 ? 3 : 4;
+    } else if(!(n = sequence_length(p, len - byte))) {
+      cp = bad;
+      return 1;
+    }
 
+    cp = p[0] & (0x7F >> n);
+    for(int i = 1 ; i < n ; i++) {
+      cp = (cp << 6) | (p[i] & 0x3F);
+    }
+    return n;
   }
 
-  ~gap_line() {
-    delete buf;
+  static bool in(const range* table, size_t size, uint32_t cp) {
+    size_t lo = 0, hi = size;
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if(cp > table[mid].last) {
+        lo = mid + 1;
+      } else if(cp < table[mid].first) {
+        hi = mid;
+      } else {
+        return true;
+      }
+    }
+    return false;
   }
 
+  /**
+   * Terminal columns taken by a non-ASCII code point: 0 for combining
+   * marks, 2 for wide east asian characters and 1 otherwise.
+   */
+  static int width(uint32_t cp) {
+    static const range zero[] = {
+      {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+      {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+      {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+      {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902}, {0x093A, 0x093A},
+      {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+      {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+      {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+      {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+      {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+    };
+    static const range wide[] = {
+      {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+      {0x2614, 0x2615}, {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF},
+      {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3},
+      {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60},
+      {0xFFE0, 0xFFE6}, {0x1F300, 0x1F64F}, {0x1F900, 0x1F9FF},
+      {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+    };
+
+    if(cp < 0x300 || cp == bad) {
+      return 1;
+    } else if(in(zero, sizeof(zero) / sizeof(zero[0]), cp)) {
+      return 0;
+    } else if(in(wide, sizeof(wide) / sizeof(wide[0]), cp)) {
+      return 2;
+    }
+    return 1;
+  }
 };
 
-
+/**
+ * x_line metadata lives in the buffer arena. Until the line is edited
+ * its text is a view of arena owned bytes, the first edit moves it into
+ * a pool backed gap_line.
+ */
 class x_line {
 public:
+  enum text_type : unsigned char { text_unknown = 0,
+                                   text_ascii,
+                                   text_utf8,
+                                   text_invalid };
+
   // Position relative to the file.
   long line_number;
-  streampos file_position;
+  streamoff file_position;
   long line_pos;
 
   // x_line data
-  string data;
-  gap_line gap_data;
-
-  x_line(int line_no,
-       streampos fpos,
-       int lpos) :
+  const char* text = nullptr;
+  int length = 0;
+  text_type text_class = text_unknown;  // cached, reset on edit
+  bool on_disk = false;  // text is what the file holds at file_position
+  bool shared = false;   // belongs to a buf_content, edit a copy
+  gap_line* gap_data = nullptr;
+
+  x_line(long line_no,
+         streamoff fpos,
+         long lpos) :
     line_number(line_no)
     ,file_position(fpos)
     ,line_pos(lpos) {}
 
-  x_line(int line_no,
-       streampos fpos,
-       int lpos,
-         const string& data):
+  x_line(long line_no,
+         streamoff fpos,
+         long lpos,
+         const char* data,
+         int len):
      line_number(line_no)
     ,file_position(fpos)
     ,line_pos(lpos)
-    ,data(data)
-    ,gap_data(data)
+    ,text(data)
+    ,length(len)
   {}
 
   x_line(): x_line(0,0,0) {}
 
   int size(){
-    return this->data.size();
+    return gap_data ? gap_data->length() : length;
   }
 
-};
-
-class buf {
-
-private:
-
-  mutex buf_w_lock;
-  mutex buf_r_lock;
-
-  // List of buffer errors
-  enum buffer_error { buffer_noerror,
-                      buffer_file_errory,
-                      buffer_no_file } ;
-
-  // file backing this buffer
-  const string file_path;
-
-  // buffer name
-  const string buffer_name;
-
-  // file stream backing the buffer.
-  fstream buffer_stream;
+  const char* data() {
+    return gap_data ? gap_data->contents() : text;
+  }
 
-  buffer_error error_code = buffer_noerror;
+  string str() {
+    return string(data(), size());
+  }
 
-  // size of buffer.
-  off_t size = 0;
+  bool is_edited() {
+    return gap_data != nullptr;
+  }
 
-  off_t fsize = 0;
-  bool modified = false;
+  text_type get_text_type() {
+    if(text_class == text_unknown) {
+      const char* p = data();
+      int n = size();
+      if(utf8::ascii_prefix(p, n) == size_t(n)) {
+        text_class = text_ascii;
+      } else {
+        text_class = utf8::validate(p, n) ? text_utf8 : text_invalid;
+      }
+    }
+    return text_class;
+  }
 
-  // current line
-  int current_lineIndex = 0 ;
+};
 
-  // list of lines of the buffer.
-  vector<x_line*> lines;
+/**
+ * Display columns of a line. A tab runs to the next tab stop, control
+ * bytes show as ^X and non-ASCII characters take their terminal width,
+ * so bytes and columns drift apart. A character is a code point plus
+ * any zero width marks following it.
+ *
+ * Long or non-ASCII lines get a col_index: (column, byte) checkpoints
+ * every stride columns, i.e. sampled width prefix sums, so finding the
+ * byte under column N is a lookup plus a scan of at most one stride.
+ */
+class col_index {
+public:
+  const static int tab_width = 8;
+  const static int stride    = 256;   // columns between checkpoints
+  const static int long_line = 4096;  // ASCII bytes before a line gets an index
+  const static int wide_line = 256;   // same for non-ASCII lines
+
+  struct mark {
+    int column;
+    int byte;
+  };
 
-  typedef pair<pair<int,int>,pair<int,int>> border;
+  vector<mark> marks;
+  int columns = 0;  // display width of the whole line
 
-  // left-top , right-bottom
-  border display_border;
+  static int ascii_width(unsigned char c, int column) {
+    if(c == '\t') {
+      return tab_width - column % tab_width;
+    } else if(c < 32 || c == 127) {
+      return 2;
+    }
+    return 1;
+  }
 
-  // index in buffer of current point
-  int displayLine = 0;
+  /**
+   * Bytes taken by the character at byte, width receives its columns.
+   */
+  static int char_at(const char* text, int len, int byte, int column,
+                     x_line::text_type type, int& width) {
+    if(type == x_line::text_ascii) {
+      width = ascii_width(text[byte], column);
+      return 1;
+    }
 
-public:
+    bool valid = type == x_line::text_utf8;
+    uint32_t cp;
+    int n = utf8::decode(text, len, byte, cp, valid);
+    width = cp < 0x80 ? ascii_width(cp, column) : max(utf8::width(cp), 1);
 
-  class buf_write_cmd {
-    virtual void write_buf(buf* buf) {
-      //lock()
+    while(byte + n < len && (text[byte + n] & 0x80)) {
+      int m = utf8::decode(text, len, byte + n, cp, valid);
+      if(utf8::width(cp) != 0) {
+        break;
+      }
+      n += m;
     }
-  };
-
-  void set_display_border(border b) {
-    this->display_border = b;
+    return n;
   }
 
-  vector<x_line*>& get_lines() {
-    return this->lines;
+  /**
+   * Width in columns of text.
+   */
+  static int width(const char* text, int len, x_line::text_type type) {
+    int column = 0;
+    for(int i = 0 ; i < len ; ) {
+      int w;
+      i += char_at(text, len, i, column, type, w);
+      column += w;
+    }
+    return column;
   }
 
-  x_line* get_line(size_t idx) {
-    if(idx >= this->lines.size()) {
-      return nullptr;
+  /**
+   * Advance from (column, byte) to the character covering target.
+   */
+  static void scan(const char* text, int len, x_line::text_type type,
+                   int target, int& column, int& byte) {
+    while(byte < len) {
+      int w;
+      int n = char_at(text, len, byte, column, type, w);
+      if(column + w > target) {
+        break;
+      }
+      column += w;
+      byte += n;
     }
-    return this->lines[idx];
   }
 
-  bool is_modified() {
-    return this->modified;
+  void build(const char* text, int len, x_line::text_type type) {
+    marks.clear();
+    int column = 0;
+    int next = 0;
+    for(int i = 0 ; i < len ; ) {
+      if(column >= next) {
+        marks.push_back({column, i});
+        next += stride;
+      }
+      int w;
+      i += char_at(text, len, i, column, type, w);
+      column += w;
+    }
+    columns = column;
   }
 
-  string get_buffer_name() {
-    return this->buffer_name;
+  /**
+   * Byte offset of the character covering display column target,
+   * column receives the column that character starts at.
+   */
+  int byte_at(const char* text, int len, x_line::text_type type,
+              int target, int& column) const {
+    int byte = 0;
+    column = 0;
+    if(!marks.empty()) {
+      size_t i = min(marks.size() - 1, size_t(max(target, 0) / stride));
+      while(i > 0 && marks[i].column > target) {
+        i--;
+      }
+      column = marks[i].column;
+      byte   = marks[i].byte;
+    }
+    scan(text, len, type, target, column, byte);
+    return byte;
   }
+};
 
-  // Avoid defaults
-  buf()  = delete;
-
- buf(const buf& buffer)  = delete;
+/**
+ * Highlight attributes, also used as the curses color pair numbers.
+ */
+enum hl_attr { hl_plain = 0,
+               hl_keyword,
+               hl_string,
+               hl_number,
+               hl_comment,
+               hl_preproc,
+               hl_key,
+               hl_error,
+               hl_warning,
+               hl_time };
+
+struct attr_run {
+  int start;
+  int end;
+  unsigned char attr;
+};
 
-  buf(string name, string path):
-      file_path(path)
-    , buffer_name(name)
-    , buffer_stream(path, ios_base::in)  {
+/**
+ * A lexer turns one line into attribute runs. Whatever must carry over
+ * to the next line (an open block comment, say) is squeezed into the
+ * returned state byte, which is all the highlighter remembers per line.
+ */
+class lexer {
+public:
+  virtual ~lexer() {}
 
-    if(buffer_stream.rdstate() && std::ifstream::failbit != 0) {
-      error_code = buffer_noerror;
-      return;
-    }
+  /**
+   * Lex a line starting in state, returns the state at its end. Runs
+   * are only produced when out is given.
+   */
+  virtual unsigned char lex(const char* text, int len, unsigned char state,
+                            vector<attr_run>* out) = 0;
 
-    this->fill(buffer_stream);
-  }
+  static lexer* for_file(const string& path);
 
-  ~buf() {
-    // close open file
-    buffer_stream.close();
-    // free all lines.
-    this->clear();
+protected:
+  static void emit(vector<attr_run>* out, int start, int end, hl_attr attr) {
+    if(out && end > start) {
+      out->push_back({start, end, (unsigned char)attr});
+    }
   }
 
-  bool is_error_state() {
-    return error_code != buffer_noerror;
+  static bool is_word(char c) {
+    return isalnum((unsigned char)c) || c == '_';
   }
 
   /**
-   * Drop all saved lines.
+   * End of the quoted string opening at i, escapes honoured.
    */
-  void clear() {
-    for(auto it = lines.begin() ; it != lines.end() ; it++) {
-      delete *it;
+  static int skip_quoted(const char* text, int len, int i) {
+    char quote = text[i++];
+    while(i < len && text[i] != quote) {
+      if(text[i] == '\\') {
+        i++;
+      }
+      i++;
     }
-    lines.clear();
+    return min(i + 1, len);
   }
 
-  /**
-   * Fill buffer with lines from the input stream.
-   */
-  void fill(istream& in) {
-    string line;
-    int line_number = 0;
-    this->clear();
-
-    while(getline(in,line)) {// the whole file is read into mem
-      x_line* cur =  new x_line(line_number, in.tellg(), 0, line);
-      app::get_logger().log(line);
-      lines.push_back(cur);
+  static int skip_number(const char* text, int len, int i) {
+    while(i < len && (isalnum((unsigned char)text[i]) || text[i] == '.' ||
+                      ((text[i] == '-' || text[i] == '+') &&
+                       (text[i-1] == 'e' || text[i-1] == 'E')))) {
+      i++;
     }
+    return i;
   }
 };
 
+class cpp_lexer : public lexer {
+public:
+  enum { lex_normal = 0, lex_comment };
+
+  unsigned char lex(const char* text, int len, unsigned char state,
+                    vector<attr_run>* out) {
+    static const unordered_set<string> keywords {
+      "alignas","alignof","auto","bool","break","case","catch","char",
+      "class","const","constexpr","continue","decltype","default","delete",
+      "do","double","else","enum","explicit","extern","false","float","for",
+      "friend","goto","if","inline","int","long","mutable","namespace","new",
+      "noexcept","nullptr","operator","override","private","protected",
+      "public","return","short","signed","sizeof","static","struct",
+      "switch","template","this","throw","true","try","typedef","typename",
+      "union","unsigned","using","virtual","void","volatile","while"};
 
-class buf_list {
+    int i = 0;
+    if(state == lex_comment) {
+      const char* end = (const char*)memmem(text, len, "*/", 2);
+      if(!end) {
+        emit(out, 0, len, hl_comment);
+        return lex_comment;
+      }
+      i = end - text + 2;
+      emit(out, 0, i, hl_comment);
+    } else {
+      while(i < len && isspace((unsigned char)text[i])) {
+        i++;
+      }
+      if(i < len && text[i] == '#') {
+        emit(out, i, len, hl_preproc);
+        return lex_normal;
+      }
+    }
 
-private:
-  vector<buf*> buffers;
-  buf* current_buffer = NULL;
+    while(i < len) {
+      char c = text[i];
+      char next = (i + 1 < len) ? text[i + 1] : 0;
+      int j;
+      if(c == '/' && next == '/') {
+        emit(out, i, len, hl_comment);
+        return lex_normal;
+      } else if(c == '/' && next == '*') {
+        const char* end = (const char*)memmem(text + i + 2, len - i - 2, "*/", 2);
+        if(!end) {
+          emit(out, i, len, hl_comment);
+          return lex_comment;
+        }
+        j = end - text + 2;
+        emit(out, i, j, hl_comment);
+      } else if(c == '"' || c == '\'') {
+        j = skip_quoted(text, len, i);
+        emit(out, i, j, hl_string);
+      } else if(isdigit((unsigned char)c)) {
+        j = skip_number(text, len, i);
+        emit(out, i, j, hl_number);
+      } else if(is_word(c)) {
+        j = i;
+        while(j < len && is_word(text[j])) {
+          j++;
+        }
+        if(j - i <= 16 && keywords.count(string(text + i, j - i))) {
+          emit(out, i, j, hl_keyword);
+        }
+      } else {
+        j = i + 1;
+      }
+      i = j;
+    }
+    return lex_normal;
+  }
+};
 
+class json_lexer : public lexer {
 public:
-  buf_list() = default;
-
-  buf_list(buf* first):
-    current_buffer(first) {
-    this->buffers.push_back(first);
+  unsigned char lex(const char* text, int len, unsigned char state,
+                    vector<attr_run>* out) {
+    if(!out) { // nothing carries across lines
+      return 0;
+    }
+    int i = 0;
+    while(i < len) {
+      char c = text[i];
+      int j;
+      if(c == '"') {
+        j = skip_quoted(text, len, i);
+        int k = j;
+        while(k < len && isspace((unsigned char)text[k])) {
+          k++;
+        }
+        emit(out, i, j, (k < len && text[k] == ':') ? hl_key : hl_string);
+      } else if(c == '-' || isdigit((unsigned char)c)) {
+        j = skip_number(text, len, i + 1);
+        emit(out, i, j, hl_number);
+      } else if(isalpha((unsigned char)c)) {
+        j = i;
+        while(j < len && isalpha((unsigned char)text[j])) {
+          j++;
+        }
+        string word(text + i, j - i);
+        emit(out, i, j, (word == "true" || word == "false" || word == "null") ?
+             hl_keyword : hl_error);
+      } else {
+        j = i + 1;
+      }
+      i = j;
+    }
+    return 0;
   }
+};
 
-  buf_list& append(buf* buffer) {
-    return this->append(*buffer);
-  }
+class log_lexer : public lexer {
+public:
+  unsigned char lex(const char* text, int len, unsigned char state,
+                    vector<attr_run>* out) {
+    if(!out) {
+      return 0;
+    }
 
-  buf_list& append(buf& buffer) {
-    this->buffers.push_back(&buffer);
-    this->current_buffer = &buffer;
-    return *this;
+    // leading timestamp: digits and the usual separators
+    int i = 0;
+    while(i < len && (isdigit((unsigned char)text[i]) ||
+                      strchr("-:.,/+TZ[]", text[i]) ||
+                      (text[i] == ' ' && i + 1 < len &&
+                       isdigit((unsigned char)text[i + 1])))) {
+      i++;
+    }
+    emit(out, 0, i, hl_time);
+
+    while(i < len) {
+      char c = text[i];
+      int j;
+      if(c == '"') {
+        j = skip_quoted(text, len, i);
+        emit(out, i, j, hl_string);
+      } else if(isdigit((unsigned char)c)) {
+        j = skip_number(text, len, i);
+        emit(out, i, j, hl_number);
+      } else if(is_word(c)) {
+        j = i;
+        while(j < len && is_word(text[j])) {
+          j++;
+        }
+        string word(text + i, min(j - i, 8));
+        if(word == "ERROR" || word == "FATAL" || word == "CRITICAL" ||
+           word == "error" || word == "fatal") {
+          emit(out, i, j, hl_error);
+        } else if(word == "WARN" || word == "WARNING" || word == "warning") {
+          emit(out, i, j, hl_warning);
+        } else if(word == "INFO" || word == "DEBUG" || word == "TRACE") {
+          emit(out, i, j, hl_keyword);
+        }
+      } else {
+        j = i + 1;
+      }
+      i = j;
+    }
+    return 0;
   }
+};
 
-  int num_buffers()  {
-    return this->buffers.size();
+lexer* lexer::for_file(const string& path) {
+  size_t dot = path.rfind('.');
+  string ext = (dot == string::npos) ? "" : path.substr(dot + 1);
+
+  if(ext == "c" || ext == "cc" || ext == "cpp" || ext == "cxx" ||
+     ext == "h" || ext == "hh" || ext == "hpp") {
+    return new cpp_lexer();
+  } else if(ext == "json") {
+    return new json_lexer();
+  } else if(ext == "log" || path.find(".log.") != string::npos) {
+    return new log_lexer();
   }
+  return nullptr;
+}
 
-  buf* get_current_buffer() {
-    return this->current_buffer;
+/**
+ * Incremental highlighting. The lexer state at the end of every line is
+ * cached, states below valid_upto are current. An edit pulls valid_upto
+ * back to the edited line and the lines after it are lexed again only
+ * until the new end state agrees with the old one, at which point the
+ * rest of the old states are taken back as they are.
+ *
+ * A worker thread lexes ahead in chunks while the buffer lock is held.
+ * The renderer lexes the lines it shows; a visible line far beyond
+ * valid_upto is drawn from a guessed state rather than blocking, and
+ * take_updated() tells the editor to redraw once the worker gets there.
+ */
+class highlighter {
+private:
+  const static size_t chunk_lines = 4096;  // lines lexed per lock hold
+  const static size_t sync_lines  = 512;   // catch up inline when this close
+  const static int    max_line    = 1 << 20;  // longer lines stay plain
+
+  unique_ptr<lexer> lang;
+  vector<x_line*>& lines;
+  mutex& lines_lock;
+
+  vector<unsigned char> end_states;
+  size_t valid_upto = 0;  // end states below are current
+  size_t stale_upto = 0;  // pre-edit end states below may still hold
+  size_t dirty_end  = 0;  // no convergence before this line
+  size_t watch_line = SIZE_MAX;  // first line drawn on a guessed state
+
+  thread worker;
+  condition_variable wake;
+  bool stop = false;
+  atomic<bool> updated;
+
+  unsigned char start_state(size_t idx) {
+    return idx == 0 ? 0 : end_states[idx - 1];
   }
 
-};
+  /**
+   * Lex forward from valid_upto up to limit, lock held.
+   */
+  void advance(size_t limit) {
+    if(end_states.size() < lines.size()) {
+      end_states.resize(lines.size());
+    }
+    limit = min(limit, lines.size());
+
+    while(valid_upto < limit) {
+      size_t i = valid_upto;
+      unsigned char state = lang->lex(lines[i]->data(), lines[i]->size(),
+                                      start_state(i), nullptr);
+      bool converged = i >= dirty_end && i < stale_upto && state == end_states[i];
+      end_states[i] = state;
+      valid_upto = converged ? stale_upto : i + 1;
+      if(valid_upto >= stale_upto) {
+        stale_upto = 0;
+        dirty_end  = 0;
+      }
+    }
 
-class display_window {
+    if(valid_upto > watch_line) {
+      watch_line = SIZE_MAX;
+      updated = true;
+    }
+  }
 
-private:
-  int num_lines;
-  int numColumns;
-  int beginY;
-  int beginX;
+  void run() {
+    unique_lock<mutex> l(lines_lock);
+    while(!stop) {
+      if(valid_upto >= lines.size()) {
+        wake.wait(l);
+        continue;
+      }
+      advance(valid_upto + chunk_lines);
 
-  WINDOW* window;
+      // let the editor at the lines between chunks
+      l.unlock();
+      this_thread::yield();
+      l.lock();
+    }
+  }
 
 public:
-  // using managed resource window
-  display_window () = delete;
-  display_window& operator=(const display_window& ) = delete;
+  highlighter(lexer* lang, vector<x_line*>& lines, mutex& lines_lock):
+     lang(lang)
+    ,lines(lines)
+    ,lines_lock(lines_lock)
+    ,updated(false) {
+    worker = thread(&highlighter::run, this);
+  }
 
-  display_window(int nl, int nc,int by, int bx):
-     num_lines(nl)
-    ,numColumns(nc)
-    ,beginY(by)
-    ,beginX(bx) {
+  highlighter(const highlighter&) = delete;
+  highlighter& operator=(const highlighter&) = delete;
 
-    window = newwin(num_lines, numColumns,
-                    beginY, beginX);
+  ~highlighter() {
+    {
+      lock_guard<mutex> l(lines_lock);
+      stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+  }
 
-    // start with cursor at beginning
-    this->move_cursor(beginY,beginX);
+  /**
+   * Line idx changed, lines_lock held by the caller.
+   */
+  void invalidate(size_t idx) {
+    if(idx < valid_upto) {
+      stale_upto = max(stale_upto, valid_upto);
+      valid_upto = idx;
+    }
+    dirty_end = max(dirty_end, idx + 1);
+    wake.notify_one();
   }
 
-  int get_height() {
-    return num_lines;
-  };
+  /**
+   * Lines [idx, idx + removed) were replaced by added new ones, the
+   * states after them move along. lines_lock held by the caller.
+   */
+  void lines_changed(size_t idx, size_t removed, size_t added) {
+    if(idx < end_states.size()) {
+      size_t gone = min(removed, end_states.size() - idx);
+      end_states.erase(end_states.begin() + idx, end_states.begin() + idx + gone);
+      end_states.insert(end_states.begin() + idx, added, 0);
+    }
+    long shift = long(added) - long(removed);
+    if(stale_upto > idx + removed) {
+      stale_upto += shift;
+    } else if(stale_upto > idx) {
+      stale_upto = idx;
+    }
+    if(valid_upto > idx) {
+      stale_upto = max(stale_upto, valid_upto + shift);
+      valid_upto = idx;
+    }
+    dirty_end = max(dirty_end, idx + added + 1);
+    wake.notify_one();
+  }
 
-  int get_width() {
-    return numColumns;
-  };
+  /**
+   * Attribute runs of line idx.
+   */
+  void runs(size_t idx, vector<attr_run>& out) {
+    lock_guard<mutex> l(lines_lock);
+    out.clear();
+    if(idx >= lines.size() || lines[idx]->size() > max_line) {
+      return;
+    }
 
-  void rewind() {
-    move_cursor(beginY,beginX);
+    if(idx > valid_upto && idx - valid_upto <= sync_lines) {
+      advance(idx);
+    }
+
+    unsigned char state = 0;
+    if(idx <= valid_upto) {
+      state = start_state(idx);
+    } else {
+      watch_line = min(watch_line, idx);
+    }
+    lang->lex(lines[idx]->data(), lines[idx]->size(), state, &out);
   }
 
-  display_window& refresh() {
-    wrefresh(window);
-    return *this;
+  /**
+   * Whether lines drawn on a guess have been lexed properly since.
+   */
+  bool take_updated() {
+    return updated.exchange(false);
   }
+};
 
-  display_window& move_cursor(int y, int x){
-    wmove(window,y,x);
-    wrefresh(window);
-    return *this;
+/**
+ * What a file on disk was when we last read or wrote it. A mismatch
+ * means someone else has been at the file.
+ */
+struct file_identity {
+  dev_t  device = 0;
+  ino_t  inode  = 0;
+  off_t  size   = 0;
+  time_t mtime  = 0;
+  long   mtime_nsec = 0;
+
+  bool read(int fd) {
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      return false;
+    }
+    set(st);
+    return true;
   }
 
-  display_window& display_line(int y, int x, const string& line) {
-    wmove(window,y,x);
-    wprintw(window,line.c_str());
-    wrefresh(window);
-    return *this;
+  bool read(const string& path) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+      return false;
+    }
+    set(st);
+    return true;
   }
 
-  display_window& display_line(string line) {
-    wprintw(window,line.c_str());
-    wrefresh(window);
-    return *this;
+  void set(const struct stat& st) {
+    device = st.st_dev;
+    inode  = st.st_ino;
+    size   = st.st_size;
+    mtime  = st.st_mtim.tv_sec;
+    mtime_nsec = st.st_mtim.tv_nsec;
   }
 
-  display_window& clear() {
-    wclear(window);
-    wmove(window,0,0);
-    wrefresh(window);
-    return *this;
+  bool operator==(const file_identity& o) const {
+    return device == o.device && inode == o.inode && size == o.size &&
+      mtime == o.mtime && mtime_nsec == o.mtime_nsec;
   }
 
-  string read_input(const string &prompt ) {
-    clear();
-    display_line(0,0,prompt);
-    char input[256];
-    echo();
-    wgetnstr(window, input, 256);
-    clear();
-    noecho();
-    return string(input);
+  bool operator!=(const file_identity& o) const {
+    return !(*this == o);
   }
 
-  ~display_window() {
-    delwin(window);
+  bool operator<(const file_identity& o) const {
+    return tie(device, inode, mtime, mtime_nsec, size) <
+      tie(o.device, o.inode, o.mtime, o.mtime_nsec, o.size);
   }
 };
 
+/**
+ * Saves a snapshot of a buffer on a thread of its own. Lines go to a
+ * temp file next to the original in large writev batches, runs of
+ * lines still as they are on disk are copied over with
+ * copy_file_range, then the temp file is fsynced and renamed over the
+ * original.
+ *
+ * The snapshot is the line pointer list plus copies of edited lines:
+ * the arena text of an x_line never changes, so the editor can go on
+ * editing while we write.
+ */
+class buf_saver {
+public:
+  enum save_state { save_running, save_done, save_failed };
+
+private:
+  const static size_t batch_bytes = 1 << 20;   // flush writev past this
+  const static size_t batch_iov   = 1024;      // or this many pieces
+  const static off_t  min_region  = 1 << 16;   // smaller runs go via memory
 
-class editor;
-class editor_command;
-class mode;
-class Next_line;
+  string file_path;
+  file_identity source;     // file the on-disk offsets refer to
+  bool has_source;
+  bool final_newline;
 
-enum  editor_mode { command_mode = 0,
-                    insert_mode  = 1,
-                    search_mode  = 2 };
+  // what each line was when the save started, the worker looks at
+  // nothing else: the editor goes on changing the lines meanwhile.
+  vector<x_line*> lines;
+  vector<bool> on_disk;
+  vector<int> sizes;
+  vector<streamoff> offsets;
+  unordered_map<size_t, string> edited;
 
-typedef map<string,editor_command*> keymap;
+  int out = -1;
+  vector<iovec> iov;
+  size_t pending = 0;
 
-class x_mode {
-private:
-  string mode_name;
-  keymap mode_map;
+  thread worker;
+  string error;
 
 public:
-  x_mode(const string& name, const keymap &cmds) :
-     mode_name(name), mode_map(cmds){}
-
-  editor_command* lookup(const string& cmd) {
-    return mode_map[cmd];
+  atomic<int> state;
+  atomic<long long> done_bytes;
+  long long total_bytes = 0;
+
+  // offset of every snapshot line in the new file.
+  vector<streamoff> positions;
+  file_identity saved;
+
+  buf_saver(const string& path, const vector<x_line*>& snapshot,
+            const file_identity& id, bool known_source, bool newline):
+     file_path(path)
+    ,source(id)
+    ,has_source(known_source)
+    ,final_newline(newline)
+    ,lines(snapshot)
+    ,state(save_running)
+    ,done_bytes(0) {
+
+    on_disk.resize(lines.size());
+    sizes.resize(lines.size());
+    offsets.resize(lines.size());
+    for(size_t i = 0 ; i < lines.size() ; i++) {
+      x_line* line = lines[i];
+      on_disk[i] = line->on_disk;
+      sizes[i] = line->size();
+      offsets[i] = line->file_position;
+      if(line->is_edited()) {
+        edited[i] = line->str();
+      }
+      total_bytes += sizes[i] + 1;
+    }
+    worker = thread(&buf_saver::run, this);
   }
-  string& get_name() { return mode_name; }
-};
 
+  buf_saver(const buf_saver&) = delete;
+  buf_saver& operator=(const buf_saver&) = delete;
 
-class editor_command {
-  friend class editor;
-  vector<string> keys;
-public:
-  editor_command() {};
-  editor_command(vector<string> & ks):keys(ks) {};
+  ~buf_saver() {
+    wait();
+  }
 
-  vector<string> & getKeys() {
-    return this->keys;
+  void wait() {
+    if(worker.joinable()) {
+      worker.join();
+    }
   }
 
-  static void keymap_add( keymap& map, editor_command* ec);
+  string get_error() {
+    return error;
+  }
 
-  virtual editor_mode operator() (editor &display, const string& cmd ) = 0;
-  ~editor_command() {}
-};
+  x_line* line_at(size_t i) {
+    return lines[i];
+  }
 
-void editor_command::keymap_add(keymap& map, editor_command* ec)
-{
-  for(auto &key : ec->getKeys()) {
-    map.insert({key,ec});
+  const vector<x_line*>& get_lines() {
+    return lines;
   }
-}
 
-// TODO: auto-gen
-class move_pg : public editor_command {
-public:
-  move_pg(): editor_command() {};
-  move_pg(vector<string> & ks): editor_command(ks) {};
-  editor_mode operator()(editor& d, const string &cmd );
-};
+  /**
+   * Saved percentage, for the mode line.
+   */
+  int percent() {
+    return total_bytes ? int(done_bytes * 100 / total_bytes) : 100;
+  }
 
-class search_fwd : public editor_command {
-public:
-  search_fwd(): editor_command() {};
-  search_fwd(vector<string> & ks): editor_command(ks) {};
-  editor_mode operator()(editor& d, const string &cmd );
-};
+private:
+  bool fail(const string& what) {
+    error = what + ": " + strerror(errno);
+    return false;
+  }
 
-class open_file : public editor_command {
-public:
-  open_file(): editor_command() {};
-  open_file(vector<string> & ks): editor_command(ks) {};
-  editor_mode operator() (editor& d, const string &cmd );
+  bool flush() {
+    size_t k = 0;
+    while(k < iov.size()) {
+      ssize_t w = writev(out, &iov[k], min(iov.size() - k, size_t(batch_iov)));
+      if(w < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        return fail("write");
+      }
+      while(w > 0) {
+        if(size_t(w) >= iov[k].iov_len) {
+          w -= iov[k++].iov_len;
+        } else {
+          iov[k].iov_base = static_cast<char*>(iov[k].iov_base) + w;
+          iov[k].iov_len -= w;
+          w = 0;
+        }
+      }
+    }
+    iov.clear();
+    pending = 0;
+    return true;
+  }
+
+  bool add(const char* data, size_t n) {
+    iov.push_back({const_cast<char*>(data), n});
+    pending += n;
+    done_bytes += n;
+    if(iov.size() >= batch_iov || pending >= batch_bytes) {
+      return flush();
+    }
+    return true;
+  }
+
+  /**
+   * Copy n bytes at off of in to the end of the temp file, in kernel
+   * when the file system lets us.
+   */
+  bool copy_region(int in, off_t off, off_t n) {
+    while(n > 0) {
+      ssize_t c = copy_file_range(in, &off, out, nullptr, n, 0);
+      if(c < 0 && errno == EINTR) {
+        continue;
+      } else if(c <= 0) {
+        break;
+      }
+      n -= c;
+      done_bytes += c;
+    }
+
+    vector<char> chunk(n > 0 ? batch_bytes : 0);
+    while(n > 0) { // copy_file_range not supported here, do it by hand
+      ssize_t r = pread(in, chunk.data(), min(off_t(chunk.size()), n), off);
+      if(r <= 0) {
+        return fail("read");
+      }
+      if(!add(chunk.data(), r) || !flush()) {
+        return false;
+      }
+      off += r;
+      n -= r;
+    }
+    return true;
+  }
+
+  /**
+   * Whether line i can come straight from the original file: it is
+   * unchanged there and so is the newline after it.
+   */
+  bool copyable(size_t i) {
+    bool newline = i + 1 < lines.size() || final_newline;
+    return on_disk[i] && newline && offsets[i] + sizes[i] < source.size;
+  }
+
+  bool write_lines(int in) {
+    static const char nl = '\n';
+    off_t out_pos = 0;
+    positions.resize(lines.size());
+
+    for(size_t i = 0 ; i < lines.size() ; i++) {
+      x_line* line = lines[i];
+
+      if(in >= 0 && copyable(i)) {
+        off_t start = offsets[i];
+        off_t end = start + sizes[i] + 1;
+        size_t j = i;
+        while(j + 1 < lines.size() && copyable(j + 1) &&
+              offsets[j + 1] == end) {
+          j++;
+          end += sizes[j] + 1;
+        }
+        if(end - start >= min_region) {
+          if(!flush() || !copy_region(in, start, end - start)) {
+            return false;
+          }
+          for(; i <= j ; i++) {
+            positions[i] = out_pos + (offsets[i] - start);
+          }
+          i = j;
+          out_pos += end - start;
+          continue;
+        }
+      }
+
+      // text and length of an x_line stay put, edits go to gap_data
+      positions[i] = out_pos;
+      auto it = edited.find(i);
+      bool ok = (it != edited.end()) ?
+        add(it->second.data(), it->second.size()) :
+        add(line->text, line->length);
+      out_pos += (it != edited.end()) ? it->second.size() : line->length;
+
+      if(ok && (i + 1 < lines.size() || final_newline)) {
+        ok = add(&nl, 1);
+        out_pos++;
+      }
+      if(!ok) {
+        return false;
+      }
+    }
+    return flush();
+  }
+
+  bool save() {
+    size_t slash = file_path.rfind('/');
+    string dir = (slash == string::npos) ? "." : file_path.substr(0, slash + 1);
+    string name = (slash == string::npos) ? file_path : file_path.substr(slash + 1);
+
+    string tmp_path = dir + (slash == string::npos ? "/" : "") +
+      "." + name + ".x-save-XXXXXX";
+    vector<char> tmp(tmp_path.begin(), tmp_path.end());
+    tmp.push_back(0);
+
+    out = mkstemp(tmp.data());
+    if(out < 0) {
+      return fail("create " + tmp_path);
+    }
+
+    // only trust offsets into the file we actually read
+    int in = -1;
+    struct stat st;
+    if(has_source && (in = open(file_path.c_str(), O_RDONLY)) >= 0) {
+      file_identity now;
+      if(!now.read(in) || now != source) {
+        close(in);
+        in = -1;
+      }
+    }
+    if(stat(file_path.c_str(), &st) == 0) {
+      fchmod(out, st.st_mode & 07777);
+    }
+
+    bool ok = write_lines(in);
+    if(in >= 0) {
+      close(in);
+    }
+
+    if(ok && app::sync_saves && fsync(out) != 0) {
+      ok = fail("fsync");
+    }
+    if(ok && !saved.read(out)) {
+      ok = fail("stat");
+    }
+    close(out);
+
+    if(ok && rename(tmp.data(), file_path.c_str()) != 0) {
+      ok = fail("rename");
+    }
+    if(!ok) {
+      unlink(tmp.data());
+      return false;
+    }
+
+    if(!app::sync_saves) {
+      return true;
+    }
+
+    // make the rename itself durable
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if(dfd >= 0) {
+      fsync(dfd);
+      close(dfd);
+    }
+    return true;
+  }
+
+  void run() {
+    state = save() ? save_done : save_failed;
+  }
 };
 
-class mv_point : public editor_command {
+/**
+ * Append-only journal of the edits made to a buffer, so they survive a
+ * crash or a dropped session. Records are appended to an in-memory
+ * batch by the editing thread and a writer thread group-commits the
+ * batch (write + fdatasync) every commit_ms or once it grows past
+ * commit_bytes, so typing never waits on the disk.
+ *
+ * The journal is named after the fingerprint of the file it applies
+ * to; reopening that exact file replays it. Every buffer showing the
+ * file writes a journal of its own, numbered in the order they took
+ * one, so the second buffer on a file replays the second journal.
+ * Each record is
+ * <varint length><payload><fnv32 of payload>, replay stops at the
+ * first torn or corrupt one.
+ */
+class edit_journal {
 public:
-  mv_point(): editor_command() {};
-  mv_point(vector<string> & ks): editor_command(ks) {};
-  editor_mode operator()(editor& d, const string &cmd);
-};
+  enum op_type : unsigned char { op_insert = 1,  // idx byte n data
+                                 op_erase,       // idx byte n
+                                 op_lines,       // idx removed count line*
+                                 op_set,         // 0 0 count (idx delta, line)*
+                                 op_subst };     // 0 0 count from to idx delta*
+
+  // A line in op_lines is <varint len << 1><data>, or when it holds
+  // what the file does <varint len << 1 | 1><varint file position>, so
+  // putting back lines read from the file costs a few bytes each.
+
+  struct record {
+    op_type type;
+    size_t idx = 0;
+    size_t byte = 0;  // lines removed for op_lines
+    size_t n = 0;     // lines added for op_lines
+    vector<string> texts;
+    vector<streamoff> positions;  // op_lines, -1 where texts holds the line
+    vector<int> byte_lengths;     // op_lines
+    vector<size_t> at;            // op_set, the line each one replaces
+    size_t end = 0;               // offset just past it in the journal
+  };
+
+private:
+  const static size_t commit_bytes = 1 << 16;
+  const static int commit_ms = 200;
+
+  string path;
+  int fd = -1;
+
+  mutex lock;
+  condition_variable wake;
+  string pending;
+  bool stop = false;
+  thread writer;
+
+  // paths of the journals open, all made and dropped by the editor thread.
+  static std::set<string>& open_paths() {
+    static std::set<string> paths;
+    return paths;
+  }
+
+  static void put_varint(string& out, uint64_t v) {
+    char buf[10];
+    int n = 0;
+    while(v >= 0x80) {
+      buf[n++] = char(v | 0x80);
+      v >>= 7;
+    }
+    buf[n++] = char(v);
+    out.append(buf, n);
+  }
+
+  static bool get_varint(const string& in, size_t& pos, uint64_t& v) {
+    v = 0;
+    for(int shift = 0 ; pos < in.size() && shift < 64 ; shift += 7) {
+      unsigned char c = in[pos++];
+      v |= uint64_t(c & 0x7F) << shift;
+      if(!(c & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * FNV-1a over 8 byte words, bulk line records run to megabytes.
+   */
+  static uint32_t checksum(const char* data, size_t n) {
+    uint64_t h = 14695981039346656037ull;
+    size_t i = 0;
+    for( ; i + 8 <= n ; i += 8) {
+      uint64_t w;
+      memcpy(&w, data + i, sizeof(w));
+      h = (h ^ w) * 1099511628211ull;
+    }
+    for( ; i < n ; i++) {
+      h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return uint32_t(h ^ (h >> 32));
+  }
+
+  static void put_line(string& out, x_line* line) {
+    if(line->on_disk) {
+      put_varint(out, uint64_t(line->size()) << 1 | 1);
+      put_varint(out, line->file_position);
+      return;
+    }
+    put_varint(out, uint64_t(line->size()) << 1);
+    out.append(line->data(), line->size());
+  }
+
+  static bool get_line(const string& in, size_t& pos, record& r) {
+    uint64_t n, fpos;
+    if(!get_varint(in, pos, n)) {
+      return false;
+    }
+    if(n & 1) {
+      if(!get_varint(in, pos, fpos)) {
+        return false;
+      }
+      r.texts.push_back(string());
+      r.positions.push_back(fpos);
+    } else {
+      if(pos + (n >> 1) > in.size()) {
+        return false;
+      }
+      r.texts.push_back(in.substr(pos, n >> 1));
+      r.positions.push_back(-1);
+      pos += n >> 1;
+    }
+    r.byte_lengths.push_back(n >> 1);
+    return true;
+  }
+
+  static string header(const file_identity& id) {
+    string h("XJRNL002");
+    put_varint(h, id.device);
+    put_varint(h, id.inode);
+    put_varint(h, id.size);
+    put_varint(h, id.mtime);
+    put_varint(h, id.mtime_nsec);
+    return h;
+  }
+
+  void append(const string& payload) {
+    uint32_t sum = checksum(payload.data(), payload.size());
+
+    lock_guard<mutex> l(lock);
+    put_varint(pending, payload.size());
+    pending += payload;
+    pending.append(reinterpret_cast<const char*>(&sum), sizeof(sum));
+    if(pending.size() >= commit_bytes) {
+      wake.notify_one();
+    }
+  }
+
+  void run() {
+    unique_lock<mutex> l(lock);
+    while(true) {
+      wake.wait_for(l, chrono::milliseconds(int(commit_ms)), [this] {
+          return stop || pending.size() >= commit_bytes; });
+
+      if(!pending.empty()) {
+        string batch;
+        batch.swap(pending);
+        l.unlock();
+        for(size_t off = 0 ; off < batch.size() ; ) {
+          ssize_t w = write(fd, batch.data() + off, batch.size() - off);
+          if(w < 0 && errno == EINTR) {
+            continue;
+          } else if(w <= 0) {
+            break;
+          }
+          off += w;
+        }
+        fdatasync(fd);
+        l.lock();
+      }
+      if(stop && pending.empty()) {
+        break;
+      }
+    }
+  }
 
-class toggle : public editor_command {
 public:
-  toggle(): editor_command() {};
-  toggle(vector<string> & ks): editor_command(ks) {};
-  editor_mode operator()(editor& d, const string &cmd);
+  /**
+   * Where journal number slot for the file with identity id lives.
+   */
+  static string path_for(const file_identity& id, int slot = 0) {
+    const char* home = getenv("HOME");
+    string dir = string(home ? home : "/tmp") + "/.x-journal";
+    mkdir(dir.c_str(), 0700);
+
+    string h = header(id);
+    uint64_t fp = 14695981039346656037ull;
+    for(char c : h) {
+      fp = (fp ^ (unsigned char)c) * 1099511628211ull;
+    }
+    char name[48];
+    if(slot) {
+      snprintf(name, sizeof(name), "/%016llx-%d.xj", (unsigned long long)fp, slot);
+    } else {
+      snprintf(name, sizeof(name), "/%016llx.xj", (unsigned long long)fp);
+    }
+    return dir + name;
+  }
+
+  /**
+   * The first journal for id no buffer is writing.
+   */
+  static string free_path(const file_identity& id) {
+    string path;
+    for(int slot = 0 ; open_paths().count(path = path_for(id, slot)) ; slot++) {
+    }
+    return path;
+  }
+
+  /**
+   * Records of an existing journal for id, false if there is none.
+   */
+  static bool read(const string& path, const file_identity& id,
+                   vector<record>& out) {
+    ifstream in(path, ios::binary);
+    if(!in) {
+      return false;
+    }
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    string h = header(id);
+    if(data.compare(0, h.size(), h) != 0) {
+      return false;
+    }
+
+    size_t pos = h.size();
+    uint64_t len;
+    while(get_varint(data, pos, len) && pos + len + 4 <= data.size()) {
+      uint32_t sum;
+      memcpy(&sum, data.data() + pos + len, sizeof(sum));
+      if(sum != checksum(data.data() + pos, len)) {
+        break;
+      }
+
+      string payload = data.substr(pos, len);
+      pos += len + 4;
+
+      size_t p = 1;
+      uint64_t a = 0, b = 0, c = 0;
+      record r;
+      r.type = op_type(payload[0]);
+      if(!get_varint(payload, p, a) || !get_varint(payload, p, b) ||
+         !get_varint(payload, p, c)) {
+        break;
+      }
+      r.idx = a;
+      r.byte = b;
+      r.n = c;
+      if(r.type == op_insert) {
+        r.texts.push_back(payload.substr(p, c));
+      } else if(r.type == op_lines) {
+        for(uint64_t i = 0 ; i < c && get_line(payload, p, r) ; i++) {
+        }
+      } else if(r.type == op_set) {
+        size_t idx = 0;
+        uint64_t delta;
+        for(uint64_t i = 0 ; i < c && get_varint(payload, p, delta) &&
+              get_line(payload, p, r) ; i++) {
+          idx += delta;
+          r.at.push_back(idx);
+        }
+        r.texts.resize(r.at.size());
+      } else if(r.type == op_subst) {
+        uint64_t n, delta;
+        size_t idx = 0;
+        for(int i = 0 ; i < 2 && get_varint(payload, p, n) &&
+              p + n <= payload.size() ; i++) {
+          r.texts.push_back(payload.substr(p, n));
+          p += n;
+        }
+        for(uint64_t i = 0 ; i < c && get_varint(payload, p, delta) ; i++) {
+          idx += delta;
+          r.at.push_back(idx);
+        }
+        if(r.texts.size() != 2 || r.at.size() != c) {
+          break;
+        }
+      }
+      r.end = pos;
+      out.push_back(r);
+    }
+    return true;
+  }
+
+  /**
+   * Bytes of the header a journal for id starts with.
+   */
+  static size_t header_size(const file_identity& id) {
+    return header(id).size();
+  }
+
+  edit_journal(const string& path, const file_identity& id): path(path) {
+    open_paths().insert(path);
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    struct stat st;
+    if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size == 0) {
+      string h = header(id);
+      if(write(fd, h.data(), h.size()) != ssize_t(h.size())) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    if(fd >= 0) {
+      writer = thread(&edit_journal::run, this);
+    }
+  }
+
+  edit_journal(const edit_journal&) = delete;
+  edit_journal& operator=(const edit_journal&) = delete;
+
+  ~edit_journal() {
+    open_paths().erase(path);
+    if(fd < 0) {
+      return;
+    }
+    {
+      lock_guard<mutex> l(lock);
+      stop = true;
+    }
+    wake.notify_one();
+    writer.join();
+    close(fd);
+  }
+
+  void insert(size_t idx, int byte, const char* data, int n) {
+    string p(1, char(op_insert));
+    put_varint(p, idx);
+    put_varint(p, byte);
+    put_varint(p, n);
+    p.append(data, n);
+    append(p);
+  }
+
+  void erase(size_t idx, int byte, int n) {
+    string p(1, char(op_erase));
+    put_varint(p, idx);
+    put_varint(p, byte);
+    put_varint(p, n);
+    append(p);
+  }
+
+  void lines(size_t idx, size_t removed, const vector<x_line*>& added) {
+    string p(1, char(op_lines));
+    p.reserve(32 + added.size() * 8);
+    put_varint(p, idx);
+    put_varint(p, removed);
+    put_varint(p, added.size());
+    for(auto line : added) {
+      put_line(p, line);
+    }
+    append(p);
+  }
+
+  /**
+   * Lines at had every from in them replaced by to.
+   */
+  void subst(const vector<size_t>& at, const string& from, const string& to) {
+    string p(1, char(op_subst));
+    p.reserve(32 + from.size() + to.size() + at.size() * 2);
+    put_varint(p, 0);
+    put_varint(p, 0);
+    put_varint(p, at.size());
+    put_varint(p, from.size());
+    p += from;
+    put_varint(p, to.size());
+    p += to;
+    size_t prev = 0;
+    for(auto idx : at) {
+      put_varint(p, idx - prev);
+      prev = idx;
+    }
+    append(p);
+  }
+
+  void set(const vector<size_t>& at, const vector<x_line*>& added) {
+    string p(1, char(op_set));
+    p.reserve(32 + added.size() * 16);
+    put_varint(p, 0);
+    put_varint(p, 0);
+    put_varint(p, added.size());
+    size_t prev = 0;
+    for(size_t i = 0 ; i < at.size() ; i++) {
+      put_varint(p, at[i] - prev);
+      prev = at[i];
+      put_line(p, added[i]);
+    }
+    append(p);
+  }
+
+  /**
+   * The edits made it into the file, the journal is of no more use.
+   */
+  void discard() {
+    unlink(path.c_str());
+  }
 };
 
-class editor {
+/**
+ * Undo history. Each command's edits form one group of operations, an
+ * operation holds what is needed to run it backwards and forwards: the
+ * bytes inserted or erased, or for line replacement just the x_line
+ * pointers that went out and came in (lines stay alive in the buffer
+ * arena, so swapping a million lines back costs a million pointers).
+ *
+ * A typing run, inserts or backspaces adjacent to the previous one on
+ * the same line, is folded into the previous group. The oldest groups
+ * are dropped whenever the history grows past its memory limit, the
+ * newest one is always kept. The cost of a group counts the lines it
+ * keeps alive in the buffer arena; what dropped groups held there is
+ * reclaimed by buf::compact.
+ */
+class undo_history {
+public:
+  enum op_type : unsigned char { op_insert, op_erase, op_lines, op_set };
+
+  struct op {
+    op_type type;
+    size_t idx;
+    int byte;
+    string text;              // inserted or erased bytes
+    vector<x_line*> removed;  // lines replaced ...
+    vector<x_line*> added;    // ... and their replacements
+    vector<size_t> at;        // op_set, the lines replaced one for one
+    string with;              // op_set from a replace of text by with
+
+    size_t cost() const {
+      size_t bytes = sizeof(op) + text.capacity() +
+        sizeof(x_line*) * (removed.capacity() + added.capacity()) +
+        sizeof(size_t) * at.capacity() + with.capacity();
+      for(auto line : removed) {  // alive only for this op's sake
+        bytes += line_bytes(line);
+      }
+      return bytes;
+    }
+
+    /**
+     * Arena and pool memory line takes, none for the shared lines of
+     * the file as read.
+     */
+    static size_t line_bytes(x_line* line) {
+      if(line->shared) {
+        return 0;
+      }
+      return sizeof(x_line) + line->length +
+        (line->gap_data ? sizeof(gap_line) + line->size() : 0);
+    }
+  };
+
+  struct group {
+    vector<op> ops;
+    size_t cost = 0;
+  };
 
 private:
-  vector<x_mode*> modes;
+  deque<group> done;
+  vector<group> undone;
+  size_t used  = 0;
+  size_t limit;
+  size_t dropped = 0;     // cost of groups let go since take_dropped
+  bool open = false;      // next op joins the last group
+  bool recording = true;  // off while undoing and redoing
+
+  void push(op&& o) {
+    if(!recording) {
+      return;
+    }
+    for(auto& g : undone) {
+      used -= g.cost;
+      dropped += g.cost;
+    }
+    undone.clear();
 
-  int screen_height = 0;
-  int screen_width  = 0;
+    if(!open && !done.empty() && coalesce(done.back(), o)) {
+      return;
+    }
+    if(!open || done.empty()) {
+      done.push_back(group());
+      open = true;
+    }
+    group& g = done.back();
+    size_t cost = o.cost();
+    used += cost;
+    g.cost += cost;
+    g.ops.push_back(std::move(o));
+    trim();
+  }
 
-  int mode_padding = 1;
-  editor_mode mode = command_mode;
+  /**
+   * Fold o into g when both are part of one typing run.
+   */
+  bool coalesce(group& g, const op& o) {
+    if(g.ops.size() != 1 || g.ops[0].type != o.type || g.ops[0].idx != o.idx) {
+      return false;
+    }
+    op& last = g.ops[0];
+    size_t before = last.cost();
+    if(o.type == op_insert && o.byte == last.byte + int(last.text.size())) {
+      last.text += o.text;
+    } else if(o.type == op_erase && o.byte + int(o.text.size()) == last.byte) {
+      last.text = o.text + last.text;
+      last.byte = o.byte;
+    } else {
+      return false;
+    }
+    used += last.cost() - before;
+    g.cost += last.cost() - before;
+    open = true;
+    return true;
+  }
 
-  display_window *mode_window = NULL;
-  display_window *buffer_window = NULL;
+  void trim() {
+    while(used > limit && done.size() > 1) {
+      used -= done.front().cost;
+      dropped += done.front().cost;
+      done.pop_front();
+    }
+  }
 
-  buf_list *buffers;
+public:
+  undo_history(size_t limit): limit(limit) {}
 
-  bool redisplay = false; // trigger a buffer-redisplay of buffer
-  bool quit = false;      // quit will cause the display loop to exit.
+  /**
+   * Forget every edit, done and undone.
+   */
+  void clear() {
+    done.clear();
+    undone.clear();
+    dropped += used;
+    used = 0;
+    open = false;
+  }
 
-  typedef pair<int,int> point;
+  /**
+   * Cost of the groups let go since the last call.
+   */
+  size_t take_dropped() {
+    size_t n = dropped;
+    dropped = 0;
+    return n;
+  }
 
-  point cursor;
-  int   start_line = 0;
+  /**
+   * Line pointers held by all ops.
+   */
+  size_t line_count() {
+    size_t n = 0;
+    auto count = [&](group& g) {
+      for(auto& o : g.ops) {
+        n += o.removed.size() + o.added.size();
+      }
+    };
+    for_each(done.begin(), done.end(), count);
+    for_each(undone.begin(), undone.end(), count);
+    return n;
+  }
 
-public:
-  bool line_number_show = false;
+  /**
+   * Point every op at to(line) instead of line.
+   */
+  void relocate(const function<x_line*(x_line*)>& to) {
+    auto move = [&](group& g) {
+      for(auto& o : g.ops) {
+        for(auto& line : o.removed) {
+          line = to(line);
+        }
+        for(auto& line : o.added) {
+          line = to(line);
+        }
+      }
+    };
+    for_each(done.begin(), done.end(), move);
+    for_each(undone.begin(), undone.end(), move);
+  }
 
-  enum move_dir { move_y = 0 , move_x };
-  enum anchor_type { no_anchor = 0 ,
-                     file_begin,
-                     file_end,
-                     line_begin,
-                     line_end,
-                     page_begin,
-                     page_end};
+  /**
+   * A new command starts, its edits make a new group.
+   */
+  void boundary() {
+    open = false;
+  }
+
+  void set_recording(bool on) {
+    recording = on;
+  }
+
+  void record_insert(size_t idx, int byte, const char* data, int n) {
+    push(op{op_insert, idx, byte, string(data, n), {}, {}, {}, string()});
+  }
+
+  void record_erase(size_t idx, int byte, const char* data, int n) {
+    push(op{op_erase, idx, byte, string(data, n), {}, {}, {}, string()});
+  }
+
+  void record_lines(size_t idx, vector<x_line*>&& removed,
+                    const vector<x_line*>& added) {
+    push(op{op_lines, idx, 0, string(), std::move(removed), added, {}, string()});
+  }
+
+  void record_set(const vector<size_t>& at, vector<x_line*>&& removed,
+                  const vector<x_line*>& added,
+                  const string& from, const string& to) {
+    push(op{op_set, at.empty() ? 0 : at[0], 0, from,
+            std::move(removed), added, at, to});
+  }
+
+  bool take_undo(group& g) {
+    if(done.empty()) {
+      return false;
+    }
+    g = std::move(done.back());
+    done.pop_back();
+    used -= g.cost;
+    open = false;
+    return true;
+  }
+
+  bool take_redo(group& g) {
+    if(undone.empty()) {
+      return false;
+    }
+    g = std::move(undone.back());
+    undone.pop_back();
+    used -= g.cost;
+    open = false;
+    return true;
+  }
+
+  void push_undone(group&& g) {
+    used += g.cost;
+    undone.push_back(std::move(g));
+  }
+
+  void push_done(group&& g) {
+    used += g.cost;
+    done.push_back(std::move(g));
+    trim();
+  }
+
+  size_t bytes_used() {
+    return used;
+  }
+
+  /**
+   * The file was replaced, no line in the history is known to be in it.
+   * Shared lines are left alone, they are the buffer's to swap out.
+   */
+  void forget_disk() {
+    auto forget = [](x_line* line) {
+      if(!line->shared) {
+        line->on_disk = false;
+      }
+    };
+    auto forget_group = [&](group& g) {
+      for(auto& o : g.ops) {
+        for_each(o.removed.begin(), o.removed.end(), forget);
+        for_each(o.added.begin(), o.added.end(), forget);
+      }
+    };
+    for_each(done.begin(), done.end(), forget_group);
+    for_each(undone.begin(), undone.end(), forget_group);
+  }
+};
+
+/**
+ * Literal search and replace over a snapshot of a buffer's lines. The
+ * lines are cut into one chunk per core, each worker finds the matches
+ * in its chunk and builds new lines for the ones that have any in an
+ * arena of its own. Nothing in the buffer changes until the caller
+ * takes the result, adopting the arenas.
+ */
+class replace_job {
+public:
+  struct chunk {
+    size_t begin = 0;
+    size_t end = 0;
+    size_t matches = 0;
+    vector<size_t> idxs;     // lines with matches ...
+    vector<x_line*> added;   // ... and what replaces them
+    line_arena arena;
+  };
+
+private:
+  const static size_t report_every = 4096;  // lines between progress updates
+
+  vector<x_line*> lines;
+  string from;
+  string to;
+
+  vector<unique_ptr<chunk>> chunks;
+  vector<thread> workers;
+  atomic<size_t> scanned;
+  atomic<int> running;
+  atomic<bool> cancelled;
+
+  void run(chunk& c) {
+    string text;
+    size_t since = 0;
+    for(size_t i = c.begin ; i < c.end && !cancelled ; i++) {
+      size_t n = substitute(lines[i]->data(), lines[i]->size(), from, to, text);
+      if(n) {
+        c.matches += n;
+        c.idxs.push_back(i);
+        c.added.push_back(c.arena.make<x_line>(-1, -1, 0,
+                                               c.arena.copy(text.data(), text.size()),
+                                               text.size()));
+      }
+      if(++since == report_every) {
+        scanned += since;
+        since = 0;
+      }
+    }
+    scanned += since;
+    running--;
+  }
+
+public:
+  /**
+   * out becomes text with every from replaced by to, returns the number
+   * of replacements; out is left alone when there are none.
+   */
+  static size_t substitute(const char* text, size_t len, const string& from,
+                           const string& to, string& out) {
+    const char* end = text + len;
+    const char* hit = static_cast<const char*>(memmem(text, len,
+                                                      from.data(), from.size()));
+    if(!hit) {
+      return 0;
+    }
+    size_t n = 0;
+    out.clear();
+    while(hit) {
+      out.append(text, hit);
+      out += to;
+      n++;
+      text = hit + from.size();
+      hit = static_cast<const char*>(memmem(text, end - text,
+                                            from.data(), from.size()));
+    }
+    out.append(text, end);
+    return n;
+  }
+
+  replace_job(const vector<x_line*>& lines, const string& from, const string& to):
+      lines(lines)
+    , from(from)
+    , to(to)
+    , scanned(0)
+    , running(0)
+    , cancelled(false) {
+    size_t n = max(1u, thread::hardware_concurrency());
+    size_t per = (lines.size() + n - 1) / n;
+    for(size_t begin = 0 ; begin < lines.size() ; begin += per) {
+      chunks.push_back(unique_ptr<chunk>(new chunk()));
+      chunks.back()->begin = begin;
+      chunks.back()->end = min(lines.size(), begin + per);
+    }
+    running = chunks.size();
+    for(auto& c : chunks) {
+      workers.push_back(thread(&replace_job::run, this, std::ref(*c)));
+    }
+  }
+
+  ~replace_job() {
+    cancel();
+    wait();
+  }
+
+  void wait() {
+    for(auto& w : workers) {
+      if(w.joinable()) {
+        w.join();
+      }
+    }
+  }
+
+  bool finished() {
+    return running == 0;
+  }
+
+  void cancel() {
+    cancelled = true;
+  }
+
+  bool was_cancelled() {
+    return cancelled;
+  }
+
+  int percent() {
+    return lines.empty() ? 100 : int(scanned * 100 / lines.size());
+  }
+
+  size_t matches() {
+    size_t n = 0;
+    for(auto& c : chunks) {
+      n += c->matches;
+    }
+    return n;
+  }
+
+  /**
+   * Gather the lines to change in line order, once finished(); their
+   * storage moves into arena.
+   */
+  void take(vector<size_t>& at, vector<x_line*>& added, line_arena& arena) {
+    for(auto& c : chunks) {
+      at.insert(at.end(), c->idxs.begin(), c->idxs.end());
+      added.insert(added.end(), c->added.begin(), c->added.end());
+      arena.adopt(c->arena);
+    }
+  }
+};
+
+/**
+ * Sort, uniq and keep/drop over a run of lines, much like the shell
+ * tools, spread over one thread per core. Lines are moved about, never
+ * copied; only the counted lines of uniq -c are new.
+ *
+ *   [first,last] sort [-n] [-r] [-u] [-k N[,M]]
+ *   [first,last] uniq [-c]
+ *   [first,last] keep text
+ *   [first,last] drop text
+ *
+ * sort compares bytes, or leading numbers with -n (others count as 0),
+ * of the whole line or, as sort(1) does, from blank separated field N
+ * to the end of the line or of field M; a field starts with the blanks
+ * before it. Lines with equal keys keep their order. -u keeps the
+ * first line of each key.
+ */
+class line_filter {
+public:
+  enum action { sort_lines, uniq_lines, keep_lines, drop_lines };
+
+private:
+  // what gets sorted, small so it moves fast
+  struct item {
+    uint64_t key;  // first 8 bytes big end first, or the number, as ordered
+    size_t idx;    // of the line, breaks ties too
+  };
+
+  action act = sort_lines;
+  bool numeric = false;
+  bool reverse = false;
+  bool unique = false;
+  bool count = false;
+  int field = 0;       // 0: the whole line
+  int last_field = 0;  // 0: to the end of the line
+  string text;     // for keep and drop
+
+  // where the key of each line is, for ties in item.key
+  vector<const char*> key_text;
+  vector<uint32_t> key_len;
+  uint32_t common = 0;  // leading bytes every key has, item.key starts past them
+
+  bool has_range = false;
+  size_t first = 0;  // 1 based, inclusive
+  size_t last = 0;
+
+  /**
+   * Call f(begin, end, i) for the i'th of one chunk per core of
+   * [0, n), each on a thread of its own.
+   */
+  template<typename F>
+  static size_t in_chunks(size_t n, F f) {
+    size_t cores = max(1u, thread::hardware_concurrency());
+    size_t per = max(size_t(1), (n + cores - 1) / cores);
+    vector<thread> workers;
+    for(size_t begin = 0 ; begin < n ; begin += per) {
+      workers.push_back(thread(f, begin, min(n, begin + per), workers.size()));
+    }
+    for(auto& w : workers) {
+      w.join();
+    }
+    return workers.size();
+  }
+
+  static bool blank(char c) {
+    return c == ' ' || c == '\t';
+  }
+
+  static double number(const char* p, const char* end) {
+    while(p < end && blank(*p)) {
+      p++;
+    }
+    bool negative = p < end && *p == '-';
+    if(p < end && (*p == '-' || *p == '+')) {
+      p++;
+    }
+    double n = 0;
+    for( ; p < end && isdigit((unsigned char)*p) ; p++) {
+      n = n * 10 + (*p - '0');
+    }
+    if(p < end && *p == '.') {
+      double scale = 1;
+      for(p++ ; p < end && isdigit((unsigned char)*p) ; p++) {
+        n += (*p - '0') * (scale /= 10);
+      }
+    }
+    return negative ? -n : n;
+  }
+
+  /**
+   * Start of field f, 1 based, the blanks before it included.
+   */
+  static const char* field_start(const char* p, const char* end, int f) {
+    for( ; f > 1 && p < end ; f--) {
+      while(p < end && blank(*p)) {
+        p++;
+      }
+      while(p < end && !blank(*p)) {
+        p++;
+      }
+    }
+    return p;
+  }
+
+  void find_key(x_line* line, size_t idx) {
+    const char* p = line->data();
+    const char* end = p + line->size();
+    if(field) {
+      const char* stop = end;
+      if(last_field) {
+        stop = field_start(p, end, last_field);
+        while(stop < end && blank(*stop)) {
+          stop++;
+        }
+        while(stop < end && !blank(*stop)) {
+          stop++;
+        }
+      }
+      p = field_start(p, end, field);
+      end = max(p, stop);
+    }
+    key_text[idx] = p;
+    key_len[idx] = end - p;
+  }
+
+  item make_item(size_t idx) {
+    const char* p = key_text[idx];
+    const char* end = p + key_len[idx];
+    item it;
+    it.idx = idx;
+    it.key = 0;
+    if(numeric) {
+      double n = number(p, end);
+      n = (n == 0) ? 0 : n;  // no -0
+      memcpy(&it.key, &n, sizeof(n));
+      it.key = (it.key >> 63) ? ~it.key : it.key | uint64_t(1) << 63;
+    } else {
+      for(uint32_t i = common ; i < common + 8 ; i++) {
+        it.key = it.key << 8 | (p + i < end ? (unsigned char)p[i] : 0);
+      }
+    }
+    return it;
+  }
+
+  int compare_keys(const item& a, const item& b) const {
+    if(a.key != b.key) {
+      return a.key < b.key ? -1 : 1;
+    }
+    if(numeric) {
+      return 0;
+    }
+    uint32_t la = key_len[a.idx], lb = key_len[b.idx];
+    uint32_t n = min(la, lb);
+    uint32_t from = common + 8;
+    if(n > from) {
+      int c = memcmp(key_text[a.idx] + from, key_text[b.idx] + from, n - from);
+      if(c) {
+        return c;
+      }
+    }
+    return la == lb ? 0 : (la < lb ? -1 : 1);
+  }
+
+  bool before(const item& a, const item& b) const {
+    int c = compare_keys(a, b);
+    if(c) {
+      return reverse ? c > 0 : c < 0;
+    }
+    return a.idx < b.idx;
+  }
+
+  static bool same_line(x_line* a, x_line* b) {
+    return a->size() == b->size() && memcmp(a->data(), b->data(), a->size()) == 0;
+  }
+
+  void sort(const vector<x_line*>& in, vector<x_line*>& out) {
+    vector<item> keys(in.size());
+    key_text.resize(in.size());
+    key_len.resize(in.size());
+    vector<size_t> runs(max(1u, thread::hardware_concurrency()));  // sorted runs start here
+    vector<uint32_t> shared(runs.size());
+    runs.resize(in_chunks(in.size(), [&](size_t begin, size_t end, size_t c) {
+        runs[c] = begin;
+        find_key(in[begin], begin);
+        shared[c] = key_len[begin];
+        for(size_t i = begin + 1 ; i < end ; i++) {
+          find_key(in[i], i);
+          uint32_t same = 0;
+          uint32_t most = min(shared[c], key_len[i]);
+          while(same < most && key_text[i][same] == key_text[begin][same]) {
+            same++;
+          }
+          shared[c] = same;
+        }
+      }));
+    // logs and the like mostly start alike, sort past what all keys share
+    common = runs.empty() ? 0 : shared[0];
+    for(size_t c = 1 ; c < runs.size() ; c++) {
+      uint32_t same = 0;
+      uint32_t most = min(shared[c], common);
+      while(same < most && key_text[runs[c]][same] == key_text[0][same]) {
+        same++;
+      }
+      common = same;
+    }
+
+    auto by_key = [this](const item& a, const item& b) { return before(a, b); };
+    in_chunks(in.size(), [&](size_t begin, size_t end, size_t c) {
+        for(size_t i = begin ; i < end ; i++) {
+          keys[i] = make_item(i);
+        }
+        std::sort(keys.begin() + begin, keys.begin() + end, by_key);
+      });
+
+    // merge runs pairwise, each pair on its own thread, till one is left
+    vector<item> merged;
+    while(runs.size() > 1) {
+      merged.resize(keys.size());
+      runs.push_back(keys.size());
+      vector<thread> workers;
+      vector<size_t> next;
+      for(size_t i = 0 ; i + 1 < runs.size() ; i += 2) {
+        size_t a = runs[i], b = runs[i + 1];
+        size_t c = (i + 2 < runs.size()) ? runs[i + 2] : b;
+        next.push_back(a);
+        workers.push_back(thread([&, a, b, c] {
+              std::merge(keys.begin() + a, keys.begin() + b,
+                         keys.begin() + b, keys.begin() + c,
+                         merged.begin() + a, by_key);
+            }));
+      }
+      for(auto& w : workers) {
+        w.join();
+      }
+      keys.swap(merged);
+      runs.swap(next);
+    }
+
+    out.reserve(keys.size());
+    for(size_t i = 0 ; i < keys.size() ; i++) {
+      if(!unique || i == 0 || compare_keys(keys[i - 1], keys[i])) {
+        out.push_back(in[keys[i].idx]);
+      }
+    }
+  }
+
+  void uniq(const vector<x_line*>& in, vector<x_line*>& out, line_arena& arena) {
+    // runs of equal lines, found per chunk, then joined across chunks
+    vector<vector<pair<x_line*,size_t>>> parts(
+        max(1u, thread::hardware_concurrency()));
+    size_t n = in_chunks(in.size(), [&](size_t begin, size_t end, size_t c) {
+        auto& runs = parts[c];
+        for(size_t i = begin ; i < end ; i++) {
+          if(!runs.empty() && same_line(runs.back().first, in[i])) {
+            runs.back().second++;
+          } else {
+            runs.push_back(make_pair(in[i], size_t(1)));
+          }
+        }
+      });
+    vector<pair<x_line*,size_t>> runs;
+    for(size_t c = 0 ; c < n ; c++) {
+      auto it = parts[c].begin();
+      if(!runs.empty() && it != parts[c].end() && same_line(runs.back().first, it->first)) {
+        runs.back().second += (it++)->second;
+      }
+      runs.insert(runs.end(), it, parts[c].end());
+    }
+
+    out.resize(runs.size());
+    if(!count) {
+      for(size_t i = 0 ; i < runs.size() ; i++) {
+        out[i] = runs[i].first;
+      }
+      return;
+    }
+    vector<line_arena> arenas(parts.size());
+    in_chunks(runs.size(), [&](size_t begin, size_t end, size_t c) {
+        string text;
+        for(size_t i = begin ; i < end ; i++) {
+          char num[24];
+          int len = snprintf(num, sizeof(num), "%7zu ", runs[i].second);
+          text.assign(num, len);
+          text.append(runs[i].first->data(), runs[i].first->size());
+          out[i] = arenas[c].make<x_line>(-1, -1, 0,
+                                          arenas[c].copy(text.data(), text.size()),
+                                          text.size());
+        }
+      });
+    for(auto& a : arenas) {
+      arena.adopt(a);
+    }
+  }
+
+  void grep(const vector<x_line*>& in, vector<x_line*>& out) {
+    vector<vector<x_line*>> parts(max(1u, thread::hardware_concurrency()));
+    bool keep = (act == keep_lines);
+    size_t n = in_chunks(in.size(), [&](size_t begin, size_t end, size_t c) {
+        for(size_t i = begin ; i < end ; i++) {
+          bool found = memmem(in[i]->data(), in[i]->size(), text.data(), text.size());
+          if(found == keep) {
+            parts[c].push_back(in[i]);
+          }
+        }
+      });
+    for(size_t c = 0 ; c < n ; c++) {
+      out.insert(out.end(), parts[c].begin(), parts[c].end());
+    }
+  }
+
+public:
+  /**
+   * Read spec, false with error set when it is not a filter.
+   */
+  bool parse(const string& spec, string& error) {
+    istringstream in(spec);
+    string word;
+    in >> word;
+    size_t comma = word.find(',');
+    if(comma != string::npos && isdigit((unsigned char)word[0])) {
+      has_range = true;
+      first = strtoull(word.c_str(), nullptr, 10);
+      last = strtoull(word.c_str() + comma + 1, nullptr, 10);
+      word.clear();
+      in >> word;
+    }
+    if(word == "keep" || word == "drop") {
+      act = (word == "keep") ? keep_lines : drop_lines;
+      in >> ws;
+      getline(in, text);
+      if(text.empty()) {
+        error = word + ": no text to look for";
+        return false;
+      }
+      return true;
+    }
+    if(word != "sort" && word != "uniq") {
+      error = "not a filter: " + spec;
+      return false;
+    }
+    act = (word == "sort") ? sort_lines : uniq_lines;
+    string flags = (act == sort_lines) ? "nruk" : "c";
+    while(in >> word) {
+      if(word[0] != '-' || word.size() < 2) {
+        error = "bad option: " + word;
+        return false;
+      }
+      for(size_t i = 1 ; i < word.size() ; i++) {
+        char f = word[i];
+        if(flags.find(f) == string::npos) {
+          error = "bad option: -" + string(1, f);
+          return false;
+        }
+        numeric = numeric || f == 'n';
+        reverse = reverse || f == 'r';
+        unique = unique || f == 'u';
+        count = count || f == 'c';
+        if(f == 'k') {
+          string n = word.substr(i + 1);
+          if(n.empty()) {
+            in >> n;
+          }
+          size_t comma = n.find(',');
+          field = atoi(n.c_str());
+          last_field = (comma == string::npos) ? 0 : atoi(n.c_str() + comma + 1);
+          if(field < 1 || (comma != string::npos && last_field < 1) ||
+             n.find_first_not_of("0123456789,") != string::npos ||
+             std::count(n.begin(), n.end(), ',') > 1) {
+            error = "-k wants a field number, or two: N,M";
+            return false;
+          }
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Lines [begin, end) of a buffer of size lines the filter is for,
+   * false when the range it was given is outside it.
+   */
+  bool range(size_t size, size_t& begin, size_t& end) {
+    if(!has_range) {
+      begin = 0;
+      end = size;
+      return true;
+    }
+    if(first < 1 || first > last || last > size) {
+      return false;
+    }
+    begin = first - 1;
+    end = last;
+    return true;
+  }
+
+  /**
+   * out gets in filtered, lines made on the way live in arena.
+   */
+  void run(const vector<x_line*>& in, vector<x_line*>& out, line_arena& arena) {
+    switch(act) {
+    case sort_lines:
+      sort(in, out);
+      break;
+    case uniq_lines:
+      uniq(in, out, arena);
+      break;
+    case keep_lines:
+    case drop_lines:
+      grep(in, out);
+      break;
+    }
+  }
+};
+
+/**
+ * Line diff of two buffers. Lines are hashed in parallel, the common
+ * prefix and suffix are cut off, lines found once on each side anchor
+ * the rest (the longest run of them in the same order on both sides)
+ * and Myers' linear space diff runs between anchors. Lines with no
+ * equal on the other side are changes outright and never reach Myers.
+ */
+class line_diff {
+public:
+  // a[a, a + a_len) became b[b, b + b_len)
+  struct hunk {
+    size_t a, a_len;
+    size_t b, b_len;
+  };
+
+private:
+  const static int max_cost = 10000;  // Myers gives up on a region past this
+
+  const vector<x_line*>& a;
+  const vector<x_line*>& b;
+
+  vector<uint64_t> hash_a, hash_b;
+  vector<uint32_t> id_a, id_b;     // equal lines share an id
+  vector<char> changed_a, changed_b;
+  vector<hunk> hunks;
+
+  static uint64_t hash(const char* data, size_t n) {
+    uint64_t h = 14695981039346656037ull ^ n;
+    size_t i = 0;
+    for( ; i + 8 <= n ; i += 8) {
+      uint64_t w;
+      memcpy(&w, data + i, sizeof(w));
+      h = (h ^ w) * 1099511628211ull;
+    }
+    for( ; i < n ; i++) {
+      h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    h ^= h >> 33;  // spread the high bits down, ids come from the low ones
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static void hash_lines(const vector<x_line*>& lines, vector<uint64_t>& out) {
+    out.resize(lines.size());
+    size_t n = max(1u, thread::hardware_concurrency());
+    size_t per = (lines.size() + n - 1) / n;
+    vector<thread> workers;
+    for(size_t begin = 0 ; begin < lines.size() ; begin += per) {
+      size_t end = min(lines.size(), begin + per);
+      workers.push_back(thread([&lines, &out, begin, end] {
+            for(size_t i = begin ; i < end ; i++) {
+              out[i] = hash(lines[i]->data(), lines[i]->size());
+            }
+          }));
+    }
+    for(auto& w : workers) {
+      w.join();
+    }
+  }
+
+  static bool equal(x_line* x, x_line* y) {
+    return x->size() == y->size() && memcmp(x->data(), y->data(), x->size()) == 0;
+  }
+
+  bool same(size_t i, size_t j) {
+    return hash_a[i] == hash_b[j] && equal(a[i], b[j]);
+  }
+
+  /**
+   * Give the lines of a[a0, a1) and b[b0, b1) ids, equal lines get the
+   * same one. Returns the number of ids.
+   */
+  uint32_t number_lines(size_t a0, size_t a1, size_t b0, size_t b1) {
+    // open addressing on the line hash, slots hold id + 1
+    size_t size = 16;
+    while(size < 2 * ((a1 - a0) + (b1 - b0))) {
+      size <<= 1;
+    }
+    vector<uint32_t> slots(size, 0);
+    vector<x_line*> first;  // a line for each id
+    vector<uint64_t> first_hash;
+
+    auto number = [&](x_line* line, uint64_t h) {
+      for(size_t i = h & (size - 1) ; ; i = (i + 1) & (size - 1)) {
+        uint32_t id = slots[i];
+        if(!id) {
+          slots[i] = first.size() + 1;
+          first.push_back(line);
+          first_hash.push_back(h);
+          return uint32_t(first.size() - 1);
+        }
+        if(first_hash[id - 1] == h && equal(first[id - 1], line)) {
+          return id - 1;
+        }
+      }
+    };
+    id_a.assign(a.size(), 0);
+    id_b.assign(b.size(), 0);
+    for(size_t i = a0 ; i < a1 ; i++) {
+      id_a[i] = number(a[i], hash_a[i]);
+    }
+    for(size_t j = b0 ; j < b1 ; j++) {
+      id_b[j] = number(b[j], hash_b[j]);
+    }
+    return first.size();
+  }
+
+  /**
+   * Myers' middle snake bisection over id sequences x and y, marking
+   * the lines that are not part of the common subsequence.
+   */
+  static void myers(const uint32_t* x, size_t n, const uint32_t* y, size_t m,
+                    char* cx, char* cy) {
+    struct range { size_t x0, x1, y0, y1; };
+    vector<range> todo {{0, n, 0, m}};
+    vector<long> vf, vb;
+
+    while(!todo.empty()) {
+      range r = todo.back();
+      todo.pop_back();
+
+      while(r.x0 < r.x1 && r.y0 < r.y1 && x[r.x0] == y[r.y0]) {
+        r.x0++;
+        r.y0++;
+      }
+      while(r.x0 < r.x1 && r.y0 < r.y1 && x[r.x1 - 1] == y[r.y1 - 1]) {
+        r.x1--;
+        r.y1--;
+      }
+      if(r.x0 == r.x1 || r.y0 == r.y1) {
+        fill(cx + r.x0, cx + r.x1, 1);
+        fill(cy + r.y0, cy + r.y1, 1);
+        continue;
+      }
+
+      long N = r.x1 - r.x0, M = r.y1 - r.y0;
+      long delta = N - M;
+      bool odd = delta & 1;
+      long max_d = min(long(max_cost), (N + M + 1) / 2);
+      long off = max_d + 1;
+      vf.assign(2 * off + 1, -1);
+      vb.assign(2 * off + 1, -1);
+      vf[off + 1] = 0;
+      vb[off + 1] = 0;
+
+      const uint32_t* X = x + r.x0;
+      const uint32_t* Y = y + r.y0;
+      bool split = false;
+      for(long d = 0 ; d <= max_d && !split ; d++) {
+        for(long k = -d ; k <= d && !split ; k += 2) {
+          long px = (k == -d || (k != d && vf[off + k - 1] < vf[off + k + 1])) ?
+            vf[off + k + 1] : vf[off + k - 1] + 1;
+          long py = px - k;
+          while(px < N && py < M && X[px] == Y[py]) {
+            px++;
+            py++;
+          }
+          vf[off + k] = px;
+          long kb = delta - k;
+          if(odd && kb >= -(d - 1) && kb <= d - 1 && vb[off + kb] >= 0 &&
+             px >= N - vb[off + kb]) {
+            todo.push_back({r.x0 + px, r.x1, r.y0 + py, r.y1});
+            todo.push_back({r.x0, r.x0 + px, r.y0, r.y0 + py});
+            split = true;
+          }
+        }
+        for(long k = -d ; k <= d && !split ; k += 2) {
+          long px = (k == -d || (k != d && vb[off + k - 1] < vb[off + k + 1])) ?
+            vb[off + k + 1] : vb[off + k - 1] + 1;
+          long py = px - k;
+          while(px < N && py < M && X[N - px - 1] == Y[M - py - 1]) {
+            px++;
+            py++;
+          }
+          vb[off + k] = px;
+          long kf = delta - k;
+          if(!odd && kf >= -d && kf <= d && vf[off + kf] >= 0 &&
+             vf[off + kf] >= N - px) {
+            long sx = vf[off + kf];
+            long sy = sx - kf;
+            todo.push_back({r.x0 + sx, r.x1, r.y0 + sy, r.y1});
+            todo.push_back({r.x0, r.x0 + sx, r.y0, r.y0 + sy});
+            split = true;
+          }
+        }
+      }
+      if(!split) {  // too far apart to be worth it, all of it changed
+        fill(cx + r.x0, cx + r.x1, 1);
+        fill(cy + r.y0, cy + r.y1, 1);
+      }
+    }
+  }
+
+  /**
+   * Diff a[a0, a1) against b[b0, b1): lines with no equal on the other
+   * side are marked right away, Myers sorts out the others.
+   */
+  void diff_region(size_t a0, size_t a1, size_t b0, size_t b1,
+                   const vector<uint32_t>& count_a, const vector<uint32_t>& count_b) {
+    vector<uint32_t> x, y;
+    vector<size_t> at_x, at_y;
+    for(size_t i = a0 ; i < a1 ; i++) {
+      if(count_b[id_a[i]]) {
+        x.push_back(id_a[i]);
+        at_x.push_back(i);
+      } else {
+        changed_a[i] = 1;
+      }
+    }
+    for(size_t j = b0 ; j < b1 ; j++) {
+      if(count_a[id_b[j]]) {
+        y.push_back(id_b[j]);
+        at_y.push_back(j);
+      } else {
+        changed_b[j] = 1;
+      }
+    }
+    vector<char> cx(x.size()), cy(y.size());
+    myers(x.data(), x.size(), y.data(), y.size(), cx.data(), cy.data());
+    for(size_t i = 0 ; i < cx.size() ; i++) {
+      changed_a[at_x[i]] = cx[i];
+    }
+    for(size_t j = 0 ; j < cy.size() ; j++) {
+      changed_b[at_y[j]] = cy[j];
+    }
+  }
+
+  void run() {
+    hash_lines(a, hash_a);
+    hash_lines(b, hash_b);
+    changed_a.assign(a.size(), 0);
+    changed_b.assign(b.size(), 0);
+
+    size_t a0 = 0, b0 = 0, a1 = a.size(), b1 = b.size();
+    while(a0 < a1 && b0 < b1 && same(a0, b0)) {
+      a0++;
+      b0++;
+    }
+    while(a0 < a1 && b0 < b1 && same(a1 - 1, b1 - 1)) {
+      a1--;
+      b1--;
+    }
+
+    uint32_t ids = number_lines(a0, a1, b0, b1);
+    vector<uint32_t> count_a(ids), count_b(ids), where_b(ids);
+    for(size_t i = a0 ; i < a1 ; i++) {
+      count_a[id_a[i]]++;
+    }
+    for(size_t j = b0 ; j < b1 ; j++) {
+      count_b[id_b[j]]++;
+      where_b[id_b[j]] = j;
+    }
+
+    // unique lines in both, the longest run of them in order on both
+    // sides (patience sorting) anchors the regions between them
+    vector<pair<size_t,size_t>> unique;
+    for(size_t i = a0 ; i < a1 ; i++) {
+      uint32_t id = id_a[i];
+      if(count_a[id] == 1 && count_b[id] == 1) {
+        unique.push_back({i, where_b[id]});
+      }
+    }
+    vector<size_t> tails, prev(unique.size());
+    for(size_t u = 0 ; u < unique.size() ; u++) {
+      auto pos = lower_bound(tails.begin(), tails.end(), unique[u].second,
+                             [&unique](size_t t, size_t j) {
+                               return unique[t].second < j; });
+      prev[u] = (pos == tails.begin()) ? size_t(-1) : *(pos - 1);
+      if(pos == tails.end()) {
+        tails.push_back(u);
+      } else {
+        *pos = u;
+      }
+    }
+    vector<pair<size_t,size_t>> anchors;
+    for(size_t u = tails.empty() ? size_t(-1) : tails.back() ; u != size_t(-1) ;
+        u = prev[u]) {
+      anchors.push_back(unique[u]);
+    }
+    reverse(anchors.begin(), anchors.end());
+    anchors.push_back({a1, b1});
+
+    size_t pa = a0, pb = b0;
+    for(auto& an : anchors) {
+      diff_region(pa, an.first, pb, an.second, count_a, count_b);
+      pa = an.first + 1;
+      pb = an.second + 1;
+    }
+
+    // walk the marks into hunks
+    size_t i = 0, j = 0;
+    while(i < a.size() || j < b.size()) {
+      hunk h {i, 0, j, 0};
+      while(i < a.size() && changed_a[i]) {
+        i++;
+      }
+      while(j < b.size() && changed_b[j]) {
+        j++;
+      }
+      h.a_len = i - h.a;
+      h.b_len = j - h.b;
+      if(h.a_len || h.b_len) {
+        hunks.push_back(h);
+      }
+      if(i < a.size() && j < b.size()) {  // a line both sides share
+        i++;
+        j++;
+      } else {
+        i = a.size();
+        j = b.size();
+      }
+    }
+  }
+
+public:
+  line_diff(const vector<x_line*>& a, const vector<x_line*>& b): a(a), b(b) {
+    run();
+  }
+
+  const vector<hunk>& get_hunks() {
+    return hunks;
+  }
+};
+
+/**
+ * Trigram index of a buffer, built on a thread of its own after load.
+ * Every trigram has a posting list of the blocks of lines holding it,
+ * delta coded varints. A query intersects the lists of its rarest
+ * trigrams to get candidate lines; the caller still matches them
+ * exactly.
+ *
+ * Lines edited in place are remembered and always handed out as
+ * candidates. Once lines come or go the line numbers are off, the index
+ * is stale and gets rebuilt when the buffer has been left alone for a
+ * while. All indexes share one memory budget, app::index_limit; lines
+ * past the point where it ran out are not indexed.
+ */
+class trigram_index {
+public:
+  struct candidates {
+    bool usable = false;  // false: scan every line
+    vector<size_t> lines;  // below scan_from, ascending
+    size_t scan_from = 0;  // lines from here on were not indexed
+  };
+
+private:
+  const static size_t chunk_lines = 4096;
+  const static size_t block_lines = 8;  // lines per posting
+  const static int quiet_ms = 500;    // rebuild after edits stop this long
+  const static int max_lists = 4;     // lists intersected per query
+  const static size_t max_ratio = 8;  // longer lists cost more than checking
+
+  struct posting {
+    string data;        // varint deltas
+    uint32_t last = 0;  // last block added
+    uint32_t count = 0;
+  };
+
+  vector<x_line*>& lines;
+  mutex& lines_lock;
+
+  // open addressing from trigram + 1 to its posting
+  vector<uint32_t> keys;
+  vector<uint32_t> slots;
+  vector<posting> postings;
+
+  size_t indexed = 0;  // lines below are in the postings
+  size_t data_bytes = 0;  // posting lists
+  size_t bytes = 0;       // all of it, as counted in total_bytes
+  bool full = false;   // out of budget
+  bool stale = false;
+  chrono::steady_clock::time_point last_change;
+  set<size_t> edited;  // lines below indexed changed in place
+
+  thread worker;
+  condition_variable wake;
+  bool stop = false;
+
+  static atomic<size_t> total_bytes;
+
+  static uint32_t key(const char* p) {
+    return (uint32_t((unsigned char)p[0]) << 16 |
+            uint32_t((unsigned char)p[1]) << 8 |
+            uint32_t((unsigned char)p[2])) + 1;
+  }
+
+  static size_t slot_of(uint32_t k, size_t size) {
+    return (k * 2654435761u) & (size - 1);
+  }
+
+  posting* lookup(uint32_t k) {
+    if(keys.empty()) {
+      return nullptr;
+    }
+    for(size_t i = slot_of(k, keys.size()) ; keys[i] ; i = (i + 1) & (keys.size() - 1)) {
+      if(keys[i] == k) {
+        return &postings[slots[i]];
+      }
+    }
+    return nullptr;
+  }
+
+  posting& insert(uint32_t k) {
+    if(postings.size() * 2 >= keys.size()) {
+      vector<uint32_t> old_keys(max(size_t(1024), keys.size() * 2), 0);
+      vector<uint32_t> old_slots(old_keys.size(), 0);
+      old_keys.swap(keys);
+      old_slots.swap(slots);
+      for(size_t i = 0 ; i < old_keys.size() ; i++) {
+        if(old_keys[i]) {
+          size_t j = slot_of(old_keys[i], keys.size());
+          while(keys[j]) {
+            j = (j + 1) & (keys.size() - 1);
+          }
+          keys[j] = old_keys[i];
+          slots[j] = old_slots[i];
+        }
+      }
+    }
+    size_t i = slot_of(k, keys.size());
+    while(keys[i]) {
+      if(keys[i] == k) {
+        return postings[slots[i]];
+      }
+      i = (i + 1) & (keys.size() - 1);
+    }
+    keys[i] = k;
+    slots[i] = postings.size();
+    postings.push_back(posting());
+    return postings.back();
+  }
+
+  size_t table_bytes() {
+    return (keys.capacity() + slots.capacity()) * sizeof(uint32_t) +
+      postings.capacity() * sizeof(posting);
+  }
+
+  /**
+   * Index the next chunk of lines, lines_lock held.
+   */
+  void index_chunk() {
+    size_t end = min(lines.size(), indexed + chunk_lines);
+    for(size_t idx = indexed ; idx < end ; idx++) {
+      const char* text = lines[idx]->data();
+      int len = lines[idx]->size();
+      size_t block = idx / block_lines;
+      for(int i = 0 ; i + 3 <= len ; i++) {
+        posting& p = insert(key(text + i));
+        if(p.count && p.last == block) {
+          continue;
+        }
+        size_t delta = p.count ? block - p.last : block;
+        size_t cap = p.data.capacity();
+        while(delta >= 0x80) {
+          p.data += char(delta | 0x80);
+          delta >>= 7;
+        }
+        p.data += char(delta);
+        data_bytes += p.data.capacity() - cap;
+        p.last = block;
+        p.count++;
+      }
+    }
+    indexed = end;
+
+    size_t now = data_bytes + table_bytes();
+    total_bytes += now - bytes;
+    bytes = now;
+    if(total_bytes > app::index_limit) {
+      full = true;
+    }
+  }
+
+  void reset() {
+    total_bytes -= bytes;
+    vector<uint32_t>().swap(keys);
+    vector<uint32_t>().swap(slots);
+    vector<posting>().swap(postings);
+    data_bytes = 0;
+    bytes = 0;
+    indexed = 0;
+    full = false;
+    stale = false;
+    edited.clear();
+  }
+
+  void run() {
+    unique_lock<mutex> l(lines_lock);
+    while(!stop) {
+      if(stale) {
+        auto ready = last_change + chrono::milliseconds(int(quiet_ms));
+        if(chrono::steady_clock::now() < ready) {
+          wake.wait_until(l, ready);
+          continue;
+        }
+        reset();
+      }
+      if(full || indexed >= lines.size()) {
+        wake.wait(l);
+        continue;
+      }
+      index_chunk();
+
+      // let the editor at the lines between chunks
+      l.unlock();
+      this_thread::yield();
+      l.lock();
+    }
+  }
+
+  static void decode(const posting& p, vector<size_t>& out) {
+    out.clear();
+    out.reserve(p.count);
+    size_t line = 0;
+    for(size_t i = 0 ; i < p.data.size() ; ) {
+      size_t delta = 0;
+      for(int shift = 0 ; ; shift += 7) {
+        unsigned char c = p.data[i++];
+        delta |= size_t(c & 0x7F) << shift;
+        if(!(c & 0x80)) {
+          break;
+        }
+      }
+      line += delta;
+      out.push_back(line);
+    }
+  }
+
+public:
+  trigram_index(vector<x_line*>& lines, mutex& lines_lock):
+      lines(lines)
+    , lines_lock(lines_lock) {
+    worker = thread(&trigram_index::run, this);
+  }
+
+  trigram_index(const trigram_index&) = delete;
+  trigram_index& operator=(const trigram_index&) = delete;
+
+  ~trigram_index() {
+    {
+      lock_guard<mutex> l(lines_lock);
+      stop = true;
+      reset();
+    }
+    wake.notify_all();
+    worker.join();
+  }
+
+  /**
+   * Line idx changed in place, lines_lock held by the caller.
+   */
+  void line_edited(size_t idx) {
+    if(!stale && idx < indexed) {
+      edited.insert(idx);
+    }
+  }
+
+  /**
+   * Lines came or went, lines_lock held by the caller.
+   */
+  void lines_moved() {
+    stale = true;
+    last_change = chrono::steady_clock::now();
+    wake.notify_one();
+  }
+
+  /**
+   * Lines that may hold pattern, lines_lock held by the caller.
+   */
+  candidates lookup(const string& pattern) {
+    candidates c;
+    if(stale || pattern.size() < 3) {
+      return c;
+    }
+    c.usable = true;
+    c.scan_from = indexed;
+
+    vector<const posting*> lists;
+    bool absent = false;
+    for(size_t i = 0 ; i + 3 <= pattern.size() && !absent ; i++) {
+      const posting* p = lookup(key(pattern.data() + i));
+      absent = !p;
+      if(p && find(lists.begin(), lists.end(), p) == lists.end()) {
+        lists.push_back(p);
+      }
+    }
+
+    vector<size_t> found;
+    if(!absent) {
+      sort(lists.begin(), lists.end(),
+           [](const posting* x, const posting* y) { return x->count < y->count; });
+      lists.resize(min(lists.size(), size_t(max_lists)));
+      decode(*lists[0], found);
+      vector<size_t> next, both;
+      for(size_t i = 1 ; i < lists.size() && !found.empty() ; i++) {
+        if(lists[i]->count > found.size() * max_ratio) {
+          break;
+        }
+        decode(*lists[i], next);
+        both.clear();
+        set_intersection(found.begin(), found.end(), next.begin(), next.end(),
+                         back_inserter(both));
+        found.swap(both);
+      }
+    }
+    if(found.size() * block_lines > indexed / 4) {
+      c.usable = false;  // a plain scan is as quick
+      return c;
+    }
+    vector<size_t> found_lines;
+    found_lines.reserve(found.size() * block_lines);
+    for(auto block : found) {
+      size_t end = min(indexed, (block + 1) * block_lines);
+      for(size_t idx = block * block_lines ; idx < end ; idx++) {
+        found_lines.push_back(idx);
+      }
+    }
+    set_union(found_lines.begin(), found_lines.end(), edited.begin(), edited.end(),
+              back_inserter(c.lines));
+    return c;
+  }
+
+  static size_t memory_used() {
+    return total_bytes;
+  }
+
+  /**
+   * Share of the lines indexed, in percent, lines_lock held.
+   */
+  int percent() {
+    if(stale) {
+      return 0;
+    }
+    return lines.empty() ? 100 : int(indexed * 100 / lines.size());
+  }
+};
+
+atomic<size_t> trigram_index::total_bytes(0);
+
+/**
+ * A file mapped read only and shown the way hexdump -C does, 16 bytes
+ * a row: offset, hex and ASCII columns. Rows are formatted from the
+ * mapping when they are shown and the kernel reads in the pages looked
+ * at, so opening costs nothing whatever the size of the file.
+ */
+class hex_file {
+public:
+  const static int row_bytes = 16;
+
+private:
+  const static size_t sniff_bytes = 8192;    // looked at to tell binary files
+  const static size_t search_chunk = 64 << 20;
+
+  int fd = -1;
+  const unsigned char* data = nullptr;
+  size_t length = 0;
+  string error;
+
+  /**
+   * 16 bytes at in as 32 hex digits and 16 printable characters.
+   */
+  static void format16(const unsigned char* in, char* hex, char* ascii) {
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    __m128i low4 = _mm_set1_epi8(0x0f);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low4);
+    __m128i lo = _mm_and_si128(v, low4);
+    // nibble n is '0' + n, and 'a' - '0' - 10 more past 9
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i zero = _mm_set1_epi8('0');
+    __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(hex), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(hex + 16), _mm_unpackhi_epi8(hi, lo));
+
+    // bytes from ' ' to '~' as they are, '.' for the rest (signed compares)
+    __m128i shown = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(' ' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+    __m128i out = _mm_or_si128(_mm_and_si128(shown, v),
+                               _mm_andnot_si128(shown, _mm_set1_epi8('.')));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(ascii), out);
+#else
+    format(in, row_bytes, hex, ascii);
+#endif
+  }
+
+  /**
+   * madvise the pages holding [off, off + n).
+   */
+  void advise(uint64_t off, uint64_t n, int advice) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = off & ~(page - 1);
+    madvise(const_cast<unsigned char*>(data) + start, off + n - start, advice);
+  }
+
+  static void format(const unsigned char* in, int n, char* hex, char* ascii) {
+    static const char digits[] = "0123456789abcdef";
+    for(int i = 0 ; i < n ; i++) {
+      hex[2 * i] = digits[in[i] >> 4];
+      hex[2 * i + 1] = digits[in[i] & 0x0f];
+      ascii[i] = (in[i] >= ' ' && in[i] < 0x7f) ? in[i] : '.';
+    }
+  }
+
+public:
+  hex_file(const string& path) {
+    fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+      error = strerror(errno);
+      return;
+    }
+    length = st.st_size;
+    if(length == 0) {
+      return;
+    }
+    void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED) {
+      error = strerror(errno);
+      length = 0;
+      return;
+    }
+    data = static_cast<const unsigned char*>(p);
+    madvise(p, length, MADV_RANDOM);  // rows are read a screenful at a time
+  }
+
+  hex_file(const hex_file&) = delete;
+  hex_file& operator=(const hex_file&) = delete;
+
+  ~hex_file() {
+    if(data) {
+      munmap(const_cast<unsigned char*>(data), length);
+    }
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+
+  /**
+   * Whether the file at path looks binary: a NUL in its first bytes.
+   */
+  static bool is_binary(const string& path) {
+    char head[sniff_bytes];
+    ifstream in(path, ios::binary);
+    in.read(head, sizeof(head));
+    return memchr(head, 0, in.gcount()) != nullptr;
+  }
+
+  size_t size() {
+    return length;
+  }
+
+  size_t rows() {
+    return (length + row_bytes - 1) / row_bytes;
+  }
+
+  string get_error() {
+    return error;
+  }
+
+  /**
+   * Hex digits of the offset column, more than 8 for files past 4G.
+   */
+  int offset_digits() {
+    int digits = 8;
+    while(digits < 16 && (uint64_t(length) >> (4 * digits))) {
+      digits++;
+    }
+    return digits;
+  }
+
+  /**
+   * Where the hex (ascii) column of byte i of a row starts.
+   */
+  int hex_column(int i) {
+    return offset_digits() + 2 + 3 * i + (i >= row_bytes / 2 ? 1 : 0);
+  }
+
+  int ascii_column(int i) {
+    return offset_digits() + 3 * row_bytes + 5 + i;
+  }
+
+  /**
+   * Row row as hexdump -C shows it.
+   */
+  string format_row(size_t row) {
+    uint64_t off = uint64_t(row) * row_bytes;
+    if(off >= length) {
+      return string();
+    }
+    int n = int(min(size_t(row_bytes), length - off));
+    char hex[2 * row_bytes], ascii[row_bytes];
+    if(n == row_bytes) {
+      format16(data + off, hex, ascii);
+    } else {
+      format(data + off, n, hex, ascii);
+    }
+
+    char offset[17];
+    snprintf(offset, sizeof(offset), "%0*llx", offset_digits(), (unsigned long long)off);
+    string out(offset);
+    out += ' ';
+    for(int i = 0 ; i < row_bytes ; i++) {
+      out += (i == row_bytes / 2) ? "  " : " ";
+      if(i < n) {
+        out.append(hex + 2 * i, 2);
+      } else {
+        out += "  ";
+      }
+    }
+    out += "  |";
+    out.append(ascii, n);
+    out += '|';
+    return out;
+  }
+
+  /**
+   * Bytes text stands for: hex digits (spaces allowed) or "quoted
+   * text". False when it is neither.
+   */
+  static bool parse_pattern(const string& text, string& bytes) {
+    bytes.clear();
+    if(!text.empty() && text[0] == '"') {
+      size_t end = text.find('"', 1);
+      bytes = text.substr(1, end == string::npos ? string::npos : end - 1);
+      return !bytes.empty();
+    }
+    string digits;
+    for(char c : text) {
+      if(isxdigit((unsigned char)c)) {
+        digits += c;
+      } else if(c != ' ') {
+        return false;
+      }
+    }
+    if(digits.empty() || digits.size() % 2) {
+      return false;
+    }
+    for(size_t i = 0 ; i < digits.size() ; i += 2) {
+      bytes += char(strtol(digits.substr(i, 2).c_str(), nullptr, 16));
+    }
+    return true;
+  }
+
+  /**
+   * First offset at or past from (going round to the start once) that
+   * holds pattern; progress(percent) is called between chunks and
+   * stops the search when it returns false.
+   */
+  bool find(const string& pattern, uint64_t from, uint64_t& at,
+            const function<bool(int)>& progress) {
+    if(pattern.empty() || pattern.size() > length) {
+      return false;
+    }
+    from = min(uint64_t(length), from);
+    // [from, end) then [0, from + pattern - 1)
+    uint64_t ranges[2][2] = {{from, length},
+                             {0, min(uint64_t(length), from + pattern.size() - 1)}};
+    uint64_t done = 0;
+    for(auto& r : ranges) {
+      for(uint64_t pos = r[0] ; pos < r[1] ; pos += search_chunk) {
+        uint64_t end = min(r[1], pos + search_chunk + pattern.size() - 1);
+        // read ahead, and let go of what was scanned: the mapping stays small
+        advise(pos, end - pos, MADV_WILLNEED);
+        const void* hit = memmem(data + pos, end - pos, pattern.data(), pattern.size());
+        advise(pos, end - pos, MADV_DONTNEED);
+        if(hit) {
+          at = static_cast<const unsigned char*>(hit) - data;
+          return true;
+        }
+        done += min(uint64_t(search_chunk), r[1] - pos);
+        if(!progress(int(done * 100 / length))) {
+          return false;
+        }
+      }
+    }
+    return false;
+  }
+};
+
+/**
+ * Random access to the text of a gzip file, after zlib's zran.c. A
+ * worker inflates the file once, front to back. Every span bytes of
+ * text it keeps a checkpoint at a deflate block boundary: where it is
+ * in both streams plus the last 32K of text, which is all inflate needs
+ * to start over there. It also notes where every stride'th line starts.
+ * Reading then inflates at most a span before it gets to what is
+ * wanted.
+ *
+ * Memory is the checkpoints, the line marks and a small read cache.
+ * When there are too many checkpoints (marks) every other one goes and
+ * span (stride) doubles, so it stays bounded whatever the file size;
+ * huge files just read a little slower.
+ */
+class gz_reader {
+private:
+  const static size_t window_size = 32768;
+  const static size_t chunk_size  = 1 << 16;
+  const static size_t max_points  = 1024;     // 32M of windows
+  const static size_t max_marks   = 1 << 20;
+  const static size_t cache_bytes = 1 << 20;  // text kept round the last read
+
+  struct checkpoint {
+    uint64_t out;     // offset in the text
+    uint64_t in;      // offset in the file of the first whole byte
+    int bits;         // bits of the byte before in still to go
+    bool header;      // gzip header starts at in, no window needed
+    string window;    // the text just before out
+  };
+
+  int fd = -1;
+  off_t file_size = 0;
+
+  mutex lock;   // guards what the worker adds
+  vector<checkpoint> points;
+  uint64_t span = 4 << 20;
+  vector<uint64_t> marks;  // where line k * stride starts
+  size_t stride = 1024;
+  size_t newlines = 0;
+  uint64_t text_size = 0;
+  uint64_t line_start = 0;  // of the last line
+  bool done = false;
+  string error;
+
+  atomic<uint64_t> bytes_in;
+  atomic<bool> stop;
+  thread worker;
+
+  // last read, main thread only
+  string cache;
+  uint64_t cache_off = 0;
+  size_t seen_lines = 0;
+  bool seen_done = false;
+
+  template<typename T>
+  static void thin(vector<T>& v) {
+    size_t keep = 0;
+    for(size_t i = 0 ; i < v.size() ; i += 2) {
+      v[keep++] = std::move(v[i]);
+    }
+    v.resize(keep);
+  }
+
+  /**
+   * Count the newlines of text newly inflated at off, lock held.
+   */
+  void note_lines(const unsigned char* from, const unsigned char* to, uint64_t off) {
+    for(const unsigned char* p = from ; p < to ; p++) {
+      p = static_cast<const unsigned char*>(memchr(p, '\n', to - p));
+      if(!p) {
+        break;
+      }
+      line_start = off + (p - from) + 1;
+      if(++newlines % stride == 0) {
+        marks.push_back(line_start);
+        if(marks.size() > max_marks) {
+          thin(marks);
+          stride *= 2;
+        }
+      }
+    }
+    text_size = off + (to - from);
+  }
+
+  void add_point(int bits, uint64_t in, uint64_t out,
+                 const unsigned char* window, size_t left) {
+    checkpoint p;
+    p.out = out;
+    p.in = in;
+    p.bits = bits;
+    p.header = false;
+    // the window is a ring, left bytes from its end are the oldest
+    p.window.assign(reinterpret_cast<const char*>(window) + window_size - left, left);
+    p.window.append(reinterpret_cast<const char*>(window), window_size - left);
+    lock_guard<mutex> l(lock);
+    points.push_back(std::move(p));
+    if(points.size() > max_points) {
+      thin(points);
+      span *= 2;
+    }
+  }
+
+  void fail(const string& why) {
+    lock_guard<mutex> l(lock);
+    error = why;
+    done = true;
+  }
+
+  void build() {
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    if(inflateInit2(&s, 47) != Z_OK) {  // gzip, 32K window
+      fail("cannot inflate");
+      return;
+    }
+    vector<unsigned char> in(chunk_size);
+    vector<unsigned char> window(window_size, 0);
+    uint64_t in_pos = 0, total_in = 0, total_out = 0, last = 0;
+    bool between = false;  // a member just ended
+    string why;
+    while(!stop) {
+      if(s.avail_in == 0) {
+        ssize_t n = pread(fd, in.data(), in.size(), in_pos);
+        if(n <= 0) {
+          why = (n < 0) ? strerror(errno) : (between ? "" : "file ends early");
+          break;
+        }
+        in_pos += n;
+        bytes_in = in_pos;
+        s.next_in = in.data();
+        s.avail_in = n;
+      }
+      if(s.avail_out == 0) {
+        s.next_out = window.data();
+        s.avail_out = window_size;
+      }
+      unsigned char* from = s.next_out;
+      total_in += s.avail_in;
+      total_out += s.avail_out;
+      int rc = inflate(&s, Z_BLOCK);
+      total_in -= s.avail_in;
+      total_out -= s.avail_out;
+      if(s.next_out != from) {
+        lock_guard<mutex> l(lock);
+        note_lines(from, s.next_out, total_out - (s.next_out - from));
+      }
+      if(rc == Z_STREAM_END) {  // another member may follow
+        inflateReset(&s);
+        between = true;
+        continue;
+      }
+      if(rc == Z_DATA_ERROR && between) {  // trailing garbage
+        break;
+      }
+      if(rc != Z_OK && rc != Z_BUF_ERROR) {
+        why = s.msg ? s.msg : "corrupt data";
+        break;
+      }
+      between = false;
+      if((s.data_type & 128) && !(s.data_type & 64) && total_out - last > span) {
+        add_point(s.data_type & 7, total_in, total_out, window.data(), s.avail_out);
+        last = total_out;
+      }
+    }
+    inflateEnd(&s);
+    lock_guard<mutex> l(lock);
+    error = why;
+    done = true;
+  }
+
+  /**
+   * Text [off, off + want) into cache, inflating from the checkpoint
+   * before off.
+   */
+  void fill(uint64_t off, size_t want) {
+    checkpoint from;
+    {
+      lock_guard<mutex> l(lock);
+      auto it = upper_bound(points.begin(), points.end(), off,
+                            [](uint64_t o, const checkpoint& p) { return o < p.out; });
+      from = *(it - 1);
+    }
+    cache.clear();
+    cache_off = off;
+
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    bool raw = !from.header;
+    if(inflateInit2(&s, raw ? -15 : 47) != Z_OK) {
+      return;
+    }
+    uint64_t in_pos = from.in;
+    if(raw) {
+      if(from.bits) {
+        unsigned char c;
+        if(pread(fd, &c, 1, in_pos - 1) != 1) {
+          inflateEnd(&s);
+          return;
+        }
+        inflatePrime(&s, from.bits, c >> (8 - from.bits));
+      }
+      inflateSetDictionary(&s, reinterpret_cast<const Bytef*>(from.window.data()),
+                           from.window.size());
+    }
+    vector<unsigned char> in(chunk_size), out(chunk_size);
+    uint64_t pos = from.out;
+    while(pos < off + want) {
+      if(s.avail_in == 0) {
+        ssize_t n = pread(fd, in.data(), in.size(), in_pos);
+        if(n <= 0) {
+          break;
+        }
+        in_pos += n;
+        s.next_in = in.data();
+        s.avail_in = n;
+      }
+      s.next_out = out.data();
+      s.avail_out = out.size();
+      int rc = inflate(&s, Z_NO_FLUSH);
+      size_t got = out.size() - s.avail_out;
+      if(pos + got > off) {
+        size_t skip = (pos < off) ? off - pos : 0;
+        cache.append(reinterpret_cast<const char*>(out.data()) + skip, got - skip);
+      }
+      pos += got;
+      if(rc == Z_STREAM_END) {
+        // next member; raw inflate leaves the 8 byte gzip trailer
+        in_pos = in_pos - s.avail_in + (raw ? 8 : 0);
+        s.avail_in = 0;
+        raw = false;
+        inflateReset2(&s, 47);
+      } else if(rc != Z_OK) {
+        break;
+      }
+    }
+    inflateEnd(&s);
+  }
+
+public:
+  gz_reader(const string& path): bytes_in(0), stop(false) {
+    fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+      error = strerror(errno);
+      done = true;
+      return;
+    }
+    file_size = st.st_size;
+    checkpoint start;
+    start.out = 0;
+    start.in = 0;
+    start.bits = 0;
+    start.header = true;
+    points.push_back(start);
+    marks.push_back(0);
+    worker = thread(&gz_reader::build, this);
+  }
+
+  gz_reader(const gz_reader&) = delete;
+  gz_reader& operator=(const gz_reader&) = delete;
+
+  ~gz_reader() {
+    stop = true;
+    if(worker.joinable()) {
+      worker.join();
+    }
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+
+  /**
+   * Whether the file at path is gzip compressed.
+   */
+  static bool is_gzip(const string& path) {
+    unsigned char magic[2] = {0, 0};
+    ifstream in(path, ios::binary);
+    in.read(reinterpret_cast<char*>(magic), 2);
+    return in && magic[0] == 0x1f && magic[1] == 0x8b;
+  }
+
+  /**
+   * Lines read so far, all of them once finished().
+   */
+  size_t line_count() {
+    lock_guard<mutex> l(lock);
+    return newlines + (done && text_size > line_start ? 1 : 0);
+  }
+
+  bool finished() {
+    lock_guard<mutex> l(lock);
+    return done;
+  }
+
+  string get_error() {
+    lock_guard<mutex> l(lock);
+    return error;
+  }
+
+  int percent() {
+    return file_size ? int(bytes_in * 100 / file_size) : 100;
+  }
+
+  /**
+   * Memory the index takes, in bytes.
+   */
+  size_t memory_used() {
+    lock_guard<mutex> l(lock);
+    return points.size() * (sizeof(checkpoint) + window_size) +
+      marks.size() * sizeof(uint64_t) + cache.capacity();
+  }
+
+  /**
+   * True when lines came in or reading ended since the last call, main
+   * thread only.
+   */
+  bool updated() {
+    size_t n = line_count();
+    bool over = finished();
+    bool changed = (n != seen_lines || over != seen_done);
+    seen_lines = n;
+    seen_done = over;
+    return changed;
+  }
+
+  /**
+   * Text [off, off + len) into out, less at the end of the text.
+   */
+  void read(uint64_t off, size_t len, string& out) {
+    if(off < cache_off || off + len > cache_off + cache.size()) {
+      fill(off, max(len, size_t(cache_bytes)));
+    }
+    out.clear();
+    if(off >= cache_off && off < cache_off + cache.size()) {
+      out.assign(cache, off - cache_off, len);
+    }
+  }
+
+  /**
+   * Lines [first, first + count) as far as they are known, each cut
+   * to max_bytes.
+   */
+  void get_lines(size_t first, size_t count, size_t max_bytes, vector<string>& out) {
+    size_t total = line_count();
+    if(first >= total) {
+      return;
+    }
+    count = min(count, total - first);
+    uint64_t off;
+    size_t skip;
+    {
+      lock_guard<mutex> l(lock);
+      off = marks[first / stride];
+      skip = first % stride;
+    }
+    string piece, line;
+    while(out.size() < count) {
+      read(off, chunk_size, piece);
+      if(piece.empty()) {
+        out.push_back(line);  // the last line, with no newline
+        break;
+      }
+      for(size_t i = 0 ; i < piece.size() && out.size() < count ; ) {
+        const char* nl = static_cast<const char*>(
+            memchr(piece.data() + i, '\n', piece.size() - i));
+        size_t end = nl ? nl - piece.data() : piece.size();
+        if(!skip && line.size() < max_bytes) {
+          line.append(piece, i, min(end - i, max_bytes - line.size()));
+        }
+        i = end + 1;
+        if(!nl) {
+          break;
+        }
+        if(skip) {
+          skip--;
+        } else {
+          out.push_back(line);
+          line.clear();
+        }
+      }
+      off += piece.size();
+    }
+  }
+};
+
+/**
+ * A file as read, shared by every buffer showing that very file. The
+ * lines and the search index over them never change: a buffer edits
+ * copies of its own and, once edited, indexes its own lines.
+ */
+struct buf_content {
+  line_arena arena;
+  vector<x_line*> lines;
+  file_identity identity;
+  bool final_newline = true;
+  bool complete = false;  // read to the end of the file
+
+  mutex lock;  // for index, the lines need none
+  unique_ptr<trigram_index> index;  // nullptr when headless
+
+  ~buf_content() {
+    index.reset();
+  }
+};
+
+class buf {
+
+private:
+
+  mutex buf_w_lock;
+  mutex buf_r_lock;
+
+  // List of buffer errors
+  enum buffer_error { buffer_noerror,
+                      buffer_file_errory,
+                      buffer_no_file } ;
+
+  // file backing this buffer
+  const string file_path;
+
+  // buffer name
+  const string buffer_name;
+
+  // file stream backing the buffer.
+  fstream buffer_stream;
+
+  buffer_error error_code = buffer_noerror;
+
+  // size of buffer.
+  off_t size = 0;
+
+  off_t fsize = 0;
+  bool modified = false;
+
+  // file the buffer was read from or last saved to.
+  file_identity identity;
+  bool has_identity = false;
+  bool final_newline = true;
+
+  // save running in the background, and how the last one went.
+  unique_ptr<buf_saver> saver;
+  bool edited_while_saving = false;  // lines came or went
+  unordered_set<x_line*> changed_while_saving;
+  string status;
+
+  // crash recovery journal for the file at identity.
+  unique_ptr<edit_journal> journal;
+
+  undo_history history;
+  size_t garbage = 0;  // arena bytes only dropped history held
+  const static size_t compact_min = 16 << 20;  // garbage worth a compaction
+
+  // current line
+  int current_lineIndex = 0 ;
+
+  // list of lines of the buffer.
+  vector<x_line*> lines;
+
+  // the file as read, maybe shown by other buffers too. Until the
+  // first edit lines are content's and so is the search index.
+  shared_ptr<buf_content> content;
+  bool sharing = false;
+
+  // line metadata and text, freed all at once.
+  line_arena arena;
+
+  // storage for gap buffers of edited lines.
+  gap_pool pool;
+
+  // column checkpoints of long lines, built on first use.
+  unordered_map<const x_line*, unique_ptr<col_index>> col_indexes;
+
+  // screen rows each soft wrapped line takes at wrap_width.
+  unordered_map<const x_line*, int> wrap_rows;
+  int wrap_width = 0;
+
+  // syntax highlighting, nullptr for files we have no lexer for.
+  unique_ptr<highlighter> highlight;
+
+  // trigram index for search, nullptr when headless.
+  unique_ptr<trigram_index> index;
+  const static size_t max_edited = 4096;  // more at once and it is rebuilt
+
+  // gzip file, read page by page and never loaded into lines.
+  unique_ptr<gz_reader> compressed;
+
+  // the file mapped for the hex view; binary files only ever have that.
+  unique_ptr<hex_file> hex;
+  bool binary = false;
+
+  typedef pair<pair<int,int>,pair<int,int>> border;
+
+  // left-top , right-bottom
+  border display_border;
+
+  // index in buffer of current point
+  int displayLine = 0;
+
+public:
+
+  enum save_outcome { save_none, save_ok, save_error };
+
+  // where the point and the scroll were when the buffer was last shown.
+  struct view {
+    pair<int,int> cursor;
+    int start_line = 0;
+    int start_col = 0;
+    int start_row = 0;
+    size_t gz_top = 0;
+    size_t hex_top = 0;
+  } last_view;
+
+  class buf_write_cmd {
+    virtual void write_buf(buf* buf) {
+      //lock()
+    }
+  };
+
+  void set_display_border(border b) {
+    this->display_border = b;
+  }
+
+  vector<x_line*>& get_lines() {
+    return this->lines;
+  }
+
+  x_line* get_line(size_t idx) {
+    if(idx >= this->lines.size()) {
+      return nullptr;
+    }
+    return this->lines[idx];
+  }
+
+  bool is_modified() {
+    return this->modified;
+  }
+
+  string get_buffer_name() {
+    return this->buffer_name;
+  }
+
+  // Avoid defaults
+  buf()  = delete;
+
+ buf(const buf& buffer)  = delete;
+
+  /**
+   * Buffer for the file at path, sharing the lines of from when given:
+   * another buffer read that very file already. With head only the
+   * first head lines are read, finish_fill() reads the rest.
+   */
+  buf(string name, string path, shared_ptr<buf_content> from = nullptr,
+      size_t head = 0):
+      file_path(path)
+    , buffer_name(name)
+    , buffer_stream(path, ios_base::in)
+    , history(app::undo_limit)  {
+
+    if(buffer_stream.rdstate() && std::ifstream::failbit != 0) {
+      error_code = buffer_noerror;
+      return;
+    }
+
+    if(from) {
+      share(from);
+      return;
+    }
+
+    has_identity = identity.read(path);
+    fsize = identity.size;
+    if(gz_reader::is_gzip(path)) {
+      compressed.reset(new gz_reader(path));
+      return;
+    }
+    if(hex_file::is_binary(path)) {
+      hex.reset(new hex_file(path));
+      binary = true;
+      return;
+    }
+    this->fill(buffer_stream, head ? head : SIZE_MAX);
+
+    lexer* lang = app::headless ? nullptr : lexer::for_file(path);
+    if(lang) {
+      highlight.reset(new highlighter(lang, lines, buf_w_lock));
+    }
+    if(content->complete) {
+      this->loaded();
+    }
+  }
+
+  /**
+   * Read the rest of a file opened with head.
+   */
+  void finish_fill() {
+    if(!content || content->complete) {
+      return;
+    }
+    {
+      lock_guard<mutex> l(buf_w_lock);
+      size_t read = lines.size();
+      this->read_lines(buffer_stream, SIZE_MAX);
+      if(highlight) {
+        highlight->lines_changed(read, 0, lines.size() - read);
+      }
+      if(index) {
+        index->lines_moved();
+      }
+    }
+    this->loaded();
+  }
+
+  /**
+   * The whole file is in: replay the journal, keep one from here on
+   * and index the lines.
+   */
+  void loaded() {
+    if(has_identity && !app::headless) {
+      this->start_journal();
+    }
+    if(!app::headless) {
+      content->index.reset(new trigram_index(content->lines, content->lock));
+    }
+  }
+
+  /**
+   * Show the lines of a file another buffer read. Edits go to a crash
+   * journal of this buffer's own: two writers would interleave their
+   * records in one journal file.
+   */
+  void share(shared_ptr<buf_content> from) {
+    content = from;
+    lines = content->lines;
+    sharing = true;
+    identity = content->identity;
+    has_identity = true;
+    fsize = identity.size;
+    final_newline = content->final_newline;
+
+    lexer* lang = app::headless ? nullptr : lexer::for_file(file_path);
+    if(lang) {
+      highlight.reset(new highlighter(lang, lines, buf_w_lock));
+    }
+    if(!app::headless) {
+      this->start_journal();
+    }
+  }
+
+  /**
+   * Take the first journal for the file no other buffer writes,
+   * replaying what a crash left in it.
+   */
+  void start_journal() {
+    string path = edit_journal::free_path(identity);
+    // a torn record or one replay stopped at would hide all after it
+    if(truncate(path.c_str(), this->recover(path)) != 0 && errno != ENOENT) {
+      unlink(path.c_str());
+    }
+    journal.reset(new edit_journal(path, identity));
+  }
+
+  /**
+   * The file as read, nullptr for files not read into lines.
+   */
+  shared_ptr<buf_content> get_content() {
+    return content;
+  }
+
+  ~buf() {
+    // let a running save finish
+    saver.reset();
+    // leaving on purpose drops unsaved edits, only a crash keeps them
+    if(journal) {
+      journal->discard();
+    }
+    journal.reset();
+    // close open file
+    buffer_stream.close();
+    // free all lines.
+    this->clear();
+  }
+
+  bool is_error_state() {
+    return error_code != buffer_noerror;
+  }
+
+  /**
+   * Drop all saved lines, lines live in the arena and their gap
+   * buffers in the pool so there is nothing to free one by one.
+   */
+  void clear() {
+    highlight.reset();
+    index.reset();
+    lines.clear();
+    content.reset();
+    sharing = false;
+    col_indexes.clear();
+    wrap_rows.clear();
+    pool.release();
+    arena.release();
+  }
+
+  /**
+   * Make line editable, moving its text into a gap buffer.
+   */
+  gap_line& edit_line(x_line* line) {
+    assert(!line->shared);
+    if(!line->gap_data) {
+      line->gap_data = arena.make<gap_line>(pool, line->text, line->length);
+    }
+    invalidate_line(line);
+    return *line->gap_data;
+  }
+
+  /**
+   * Forget everything cached about the layout of line.
+   */
+  void invalidate_line(x_line* line) {
+    line->text_class = x_line::text_unknown;
+    col_indexes.erase(line);
+    wrap_rows.erase(line);
+  }
+
+  /**
+   * Column checkpoints for line, nullptr when it is short enough to
+   * scan from the start.
+   */
+  col_index* get_col_index(x_line* line) {
+    x_line::text_type type = line->get_text_type();
+    int threshold = (type == x_line::text_ascii) ?
+      col_index::long_line : col_index::wide_line;
+
+    if(line->size() < threshold) {
+      return nullptr;
+    }
+    unique_ptr<col_index>& idx = col_indexes[line];
+    if(!idx) {
+      idx.reset(new col_index());
+      idx->build(line->data(), line->size(), type);
+    }
+    return idx.get();
+  }
+
+  /**
+   * Highlight runs of line idx, empty when the buffer has no lexer.
+   */
+  void line_attrs(size_t idx, vector<attr_run>& out) {
+    out.clear();
+    if(highlight) {
+      highlight->runs(idx, out);
+    }
+  }
+
+  /**
+   * Whether highlighting has caught up with lines shown on a guess.
+   */
+  bool highlight_updated() {
+    return highlight && highlight->take_updated();
+  }
+
+  /**
+   * Reader of a gzip file shown read only, nullptr for other files.
+   */
+  gz_reader* get_compressed() {
+    return compressed.get();
+  }
+
+  /**
+   * The file mapped for the hex view, mapped on first use.
+   */
+  hex_file* get_hex() {
+    if(!hex) {
+      hex.reset(new hex_file(file_path));
+    }
+    return hex.get();
+  }
+
+  /**
+   * Binary file, there is nothing but the hex view of it.
+   */
+  bool is_binary() {
+    return binary;
+  }
+
+  /**
+   * Display columns taken by line.
+   */
+  int line_columns(x_line* line) {
+    col_index* idx = get_col_index(line);
+    if(idx) {
+      return idx->columns;
+    }
+    return col_index::width(line->data(), line->size(), line->get_text_type());
+  }
+
+  /**
+   * Screen rows line takes when soft wrapped at width columns. Counts
+   * are only computed for lines that get looked at and the cache is
+   * dropped as a whole when the width changes.
+   */
+  int visual_rows(x_line* line, int width) {
+    if(width != wrap_width) {
+      wrap_rows.clear();
+      wrap_width = width;
+    }
+    auto it = wrap_rows.find(line);
+    if(it != wrap_rows.end()) {
+      return it->second;
+    }
+    int rows = max(1, (line_columns(line) + width - 1) / width);
+    wrap_rows.insert({line, rows});
+    return rows;
+  }
+
+  /**
+   * Fill buffer with up to limit lines from the input stream.
+   */
+  void fill(istream& in, size_t limit = SIZE_MAX) {
+    this->clear();
+    content = make_shared<buf_content>();
+    content->identity = identity;
+    sharing = true;
+    this->read_lines(in, limit);
+  }
+
+  /**
+   * Read up to limit more lines from in after those read so far.
+   */
+  void read_lines(istream& in, size_t limit) {
+    string line;
+    vector<x_line*>& read = content->lines;
+    line_arena& text = content->arena;
+    size_t first = read.size();
+    long line_number = read.size();
+    streamoff file_position = read.empty() ? 0 :
+      read.back()->file_position + read.back()->length + 1;
+
+    for(size_t n = 0 ; n < limit && getline(in,line) ; n++) {
+      x_line* cur = text.make<x_line>(line_number++, file_position, 0,
+                                      text.copy(line.data(), line.size()),
+                                      line.size());
+      cur->on_disk = true;
+      cur->shared = true;
+      file_position += line.size() + 1;
+      read.push_back(cur);
+    }
+    lines.insert(lines.end(), read.begin() + first, read.end());
+
+    content->complete = !in || in.eof();
+    if(content->complete) {
+      // getline cannot tell us whether the last line had its newline
+      final_newline = !has_identity || file_position <= fsize;
+      content->final_newline = final_newline;
+    }
+  }
+
+  /**
+   * No other buffer shows the file as read: its lines become ours, to
+   * change like any other. Callers hold the buffer lock.
+   */
+  void take_content() {
+    this->unshare();
+    for(auto line : content->lines) {
+      line->shared = false;
+    }
+    arena.adopt(content->arena);
+    content.reset();
+  }
+
+  /**
+   * About to edit: from here on the buffer indexes lines of its own.
+   */
+  void unshare() {
+    if(!sharing) {
+      return;
+    }
+    sharing = false;
+    if(!app::headless) {
+      index.reset(new trigram_index(lines, buf_w_lock));
+    }
+  }
+
+  /**
+   * Line idx, copied first when it is shared with other buffers. Any
+   * x_line* for idx taken before an edit may be stale after it.
+   */
+  x_line* own_line(size_t idx) {
+    unshare();
+    x_line* line = lines[idx];
+    if(line->shared) {
+      line = arena.make<x_line>(*line);
+      line->shared = false;
+      lines[idx] = line;
+    }
+    return line;
+  }
+
+  mutex& get_lock() {
+    return buf_w_lock;
+  }
+
+  /**
+   * Line idx was edited in place: drop what was cached about it.
+   * Callers hold the buffer lock.
+   */
+  void line_changed(size_t idx) {
+    x_line* line = lines[idx];
+    line->on_disk = false;
+    if(line->gap_data) {  // readers on other threads must not move the gap
+      line->gap_data->contents();
+    }
+    invalidate_line(line);
+    if(highlight) {
+      highlight->invalidate(idx);
+    }
+    if(index) {
+      index->line_edited(idx);
+    }
+    modified = true;
+    if(saver) {
+      changed_while_saving.insert(line);
+    }
+  }
+
+  /**
+   * New line holding a copy of data, not yet part of the buffer.
+   */
+  x_line* make_line(const char* data, int len) {
+    return arena.make<x_line>(-1, -1, 0, arena.copy(data, len), len);
+  }
+
+  void insert_text(size_t idx, int byte, const char* data, int n) {
+    lock_guard<mutex> l(buf_w_lock);
+    history.record_insert(idx, byte, data, n);
+    edit_line(own_line(idx)).insert(byte, data, n);
+    line_changed(idx);
+    if(journal) {
+      journal->insert(idx, byte, data, n);
+    }
+  }
+
+  void erase_text(size_t idx, int byte, int n) {
+    lock_guard<mutex> l(buf_w_lock);
+    history.record_erase(idx, byte, lines[idx]->data() + byte, n);
+    edit_line(own_line(idx)).erase(byte, n);
+    line_changed(idx);
+    if(journal) {
+      journal->erase(idx, byte, n);
+    }
+  }
+
+  /**
+   * Replace lines [idx, idx + removed) with added.
+   */
+  void replace_lines(size_t idx, size_t removed, const vector<x_line*>& added) {
+    lock_guard<mutex> l(buf_w_lock);
+    unshare();
+    history.record_lines(idx, vector<x_line*>(lines.begin() + idx,
+                                              lines.begin() + idx + removed),
+                         added);
+    lines.erase(lines.begin() + idx, lines.begin() + idx + removed);
+    lines.insert(lines.begin() + idx, added.begin(), added.end());
+    if(highlight) {
+      highlight->lines_changed(idx, removed, added.size());
+    }
+    if(index) {
+      index->lines_moved();
+    }
+    if(journal) {
+      journal->lines(idx, removed, added);
+    }
+    modified = true;
+    edited_while_saving = edited_while_saving || saver != nullptr;
+  }
+
+  /**
+   * Put added[i] in place of line at[i], at ascending. Many scattered
+   * lines change as one edit: one undo op, one journal record. When
+   * from is given the new lines are the old ones with from replaced by
+   * to, which is all the journal needs to keep.
+   */
+  void set_lines(const vector<size_t>& at, const vector<x_line*>& added,
+                 const string& from = string(), const string& to = string()) {
+    if(at.empty()) {
+      return;
+    }
+    lock_guard<mutex> l(buf_w_lock);
+    unshare();
+    vector<x_line*> removed;
+    removed.reserve(at.size());
+    for(size_t i = 0 ; i < at.size() ; i++) {
+      removed.push_back(lines[at[i]]);
+      lines[at[i]] = added[i];
+    }
+    history.record_set(at, std::move(removed), added, from, to);
+    if(highlight) {  // relexing runs from the first through the last
+      highlight->invalidate(at.front());
+      highlight->invalidate(at.back());
+    }
+    if(index && at.size() > size_t(max_edited)) {
+      index->lines_moved();
+    } else if(index) {
+      for(auto idx : at) {
+        index->line_edited(idx);
+      }
+    }
+    if(journal && !from.empty()) {
+      journal->subst(at, from, to);
+    } else if(journal) {
+      journal->set(at, added);
+    }
+    modified = true;
+    edited_while_saving = edited_while_saving || saver != nullptr;
+  }
+
+  /**
+   * Edits from here on belong to a new undo group.
+   */
+  void undo_boundary() {
+    history.boundary();
+    garbage += history.take_dropped();
+    if(garbage > size_t(compact_min) && garbage > arena.bytes_used() / 2) {
+      compact();
+    }
+  }
+
+  /**
+   * Move the lines still in use, by the buffer or its history, to a
+   * fresh arena and free the old one with the gap buffers: arena and
+   * pool never free piecemeal, so this is how memory of dropped history
+   * comes back. Edited lines leave their gap buffers on the way.
+   */
+  void compact() {
+    if(saver) {  // its snapshot points at our lines
+      return;
+    }
+    lock_guard<mutex> l(buf_w_lock);
+    line_arena fresh;
+
+    // old line -> copy, open addressing: millions of map nodes cost
+    // more than copying the lines
+    int bits = 4;
+    while((size_t(1) << bits) < 2 * (lines.size() + history.line_count())) {
+      bits++;
+    }
+    vector<pair<x_line*, x_line*>> moved(size_t(1) << bits);
+    auto move = [&](x_line* line) -> x_line* {
+      if(line->shared) {
+        return line;
+      }
+      size_t i = (uintptr_t(line) * 11400714819323198485ull) >> (64 - bits);
+      while(moved[i].first && moved[i].first != line) {
+        i = (i + 1) & (moved.size() - 1);
+      }
+      moved[i].first = line;
+      x_line*& copy = moved[i].second;
+      if(!copy) {
+        copy = fresh.make<x_line>(line->line_number, line->file_position,
+                                  line->line_pos,
+                                  fresh.copy(line->data(), line->size()),
+                                  line->size());
+        copy->on_disk = line->on_disk;
+        copy->text_class = line->text_class;
+      }
+      return copy;
+    };
+    for(auto& line : lines) {
+      line = move(line);
+    }
+    history.relocate(move);
+    col_indexes.clear();
+    wrap_rows.clear();
+    arena.release();
+    arena.adopt(fresh);
+    pool.release();
+    garbage = 0;
+    malloc_trim(0);  // hand the freed blocks back
+  }
+
+  /**
+   * Run op backwards (or forwards), returns the line and byte it
+   * touched last.
+   */
+  pair<size_t,int> apply(const undo_history::op& o, bool backwards) {
+    if(o.type == undo_history::op_lines) {
+      const vector<x_line*>& out = backwards ? o.added : o.removed;
+      const vector<x_line*>& in  = backwards ? o.removed : o.added;
+      replace_lines(o.idx, out.size(), in);
+      return make_pair(o.idx, 0);
+    }
+    if(o.type == undo_history::op_set) {
+      if(backwards) {
+        set_lines(o.at, o.removed);
+      } else {
+        set_lines(o.at, o.added, o.text, o.with);
+      }
+      return make_pair(o.idx, 0);
+    }
+
+    bool insert = (o.type == undo_history::op_insert) != backwards;
+    if(insert) {
+      insert_text(o.idx, o.byte, o.text.data(), o.text.size());
+      return make_pair(o.idx, o.byte + int(o.text.size()));
+    }
+    erase_text(o.idx, o.byte, o.text.size());
+    return make_pair(o.idx, o.byte);
+  }
+
+  /**
+   * Take back the last group of edits, false when there is none.
+   * where receives the line and byte to put the point on.
+   */
+  bool undo(pair<size_t,int>& where) {
+    undo_history::group g;
+    if(!history.take_undo(g)) {
+      return false;
+    }
+    history.set_recording(false);
+    for(auto it = g.ops.rbegin() ; it != g.ops.rend() ; it++) {
+      where = apply(*it, true);
+    }
+    history.set_recording(true);
+    history.push_undone(std::move(g));
+    return true;
+  }
+
+  bool redo(pair<size_t,int>& where) {
+    undo_history::group g;
+    if(!history.take_redo(g)) {
+      return false;
+    }
+    history.set_recording(false);
+    for(auto& o : g.ops) {
+      where = apply(o, false);
+    }
+    history.set_recording(true);
+    history.push_done(std::move(g));
+    return true;
+  }
+
+  /**
+   * New lines for the lines of journal record r. Lines the record points
+   * into the file for come from original, the lines as read; false if
+   * one is not there.
+   */
+  bool record_lines(const edit_journal::record& r,
+                    const vector<x_line*>& original, vector<x_line*>& added) {
+    auto by_position = [](const x_line* l, streamoff pos) {
+      return l->file_position < pos;
+    };
+    for(size_t i = 0 ; i < r.texts.size() ; i++) {
+      if(r.positions[i] < 0) {
+        added.push_back(make_line(r.texts[i].data(), r.texts[i].size()));
+        continue;
+      }
+      auto it = lower_bound(original.begin(), original.end(),
+                            r.positions[i], by_position);
+      if(it == original.end() || (*it)->file_position != r.positions[i] ||
+         (*it)->length != r.byte_lengths[i]) {
+        return false;
+      }
+      x_line* line = arena.make<x_line>(-1, r.positions[i], 0,
+                                        (*it)->text, (*it)->length);
+      line->on_disk = true;
+      added.push_back(line);
+    }
+    return true;
+  }
+
+  /**
+   * Replay the journal at path left behind for this very file, if any.
+   * Returns the bytes of it that hold the records applied, 0 when it is
+   * not a journal for this file.
+   */
+  size_t recover(const string& path) {
+    vector<edit_journal::record> records;
+    if(!edit_journal::read(path, identity, records)) {
+      return 0;
+    }
+
+    // lines as read, in file order, for records that point into the file
+    vector<x_line*> original(lines);
+
+    size_t applied = 0;
+    history.set_recording(false);
+    for(auto& r : records) {
+      vector<x_line*> added;
+      if(r.type == edit_journal::op_lines) {
+        if(r.idx + r.byte > lines.size() || !record_lines(r, original, added)) {
+          break;
+        }
+        replace_lines(r.idx, r.byte, added);
+      } else if(r.type == edit_journal::op_set) {
+        if((!r.at.empty() && r.at.back() >= lines.size()) ||
+           !record_lines(r, original, added)) {
+          break;
+        }
+        set_lines(r.at, added);
+      } else if(r.type == edit_journal::op_subst) {
+        if(!r.at.empty() && r.at.back() >= lines.size()) {
+          break;
+        }
+        string text;
+        for(auto idx : r.at) {
+          if(!replace_job::substitute(lines[idx]->data(), lines[idx]->size(),
+                                      r.texts[0], r.texts[1], text)) {
+            text.assign(lines[idx]->data(), lines[idx]->size());
+          }
+          added.push_back(make_line(text.data(), text.size()));
+        }
+        set_lines(r.at, added, r.texts[0], r.texts[1]);
+      } else {
+        if(r.idx >= lines.size() || r.byte > size_t(lines[r.idx]->size())) {
+          break;
+        }
+        if(r.type == edit_journal::op_insert) {
+          insert_text(r.idx, r.byte, r.texts[0].data(), r.texts[0].size());
+        } else if(r.type == edit_journal::op_erase) {
+          erase_text(r.idx, r.byte, r.n);
+        } else {
+          break;
+        }
+      }
+      applied++;
+    }
+    history.set_recording(true);
+    if(applied) {
+      status = "recovered " + to_string(applied) + " edits, R reverts";
+    }
+    return applied ? records[applied - 1].end : edit_journal::header_size(identity);
+  }
+
+  /**
+   * Start a journal for the file just saved. Edits made while the save
+   * ran are not in the file, so they go in as the first records:
+   * lines that came or went as one replacement of the range between
+   * the common prefix and suffix, lines edited in place one by one.
+   */
+  void rebase_journal(const vector<x_line*>& saved) {
+    if(journal) {
+      journal->discard();
+    }
+    journal.reset();
+    if(app::headless) {
+      return;
+    }
+    journal.reset(new edit_journal(edit_journal::free_path(identity), identity));
+
+    size_t prefix = 0;
+    while(prefix < saved.size() && prefix < lines.size() &&
+          saved[prefix] == lines[prefix]) {
+      prefix++;
+    }
+    size_t suffix = 0;
+    while(suffix < saved.size() - prefix && suffix < lines.size() - prefix &&
+          saved[saved.size() - 1 - suffix] == lines[lines.size() - 1 - suffix]) {
+      suffix++;
+    }
+
+    if(prefix + suffix < max(saved.size(), lines.size())) {
+      vector<x_line*> middle(lines.begin() + prefix, lines.end() - suffix);
+      journal->lines(prefix, saved.size() - prefix - suffix, middle);
+    }
+    for(size_t i = 0 ; i < lines.size() ; i++) {
+      if((i < prefix || i >= lines.size() - suffix) &&
+         changed_while_saving.count(lines[i])) {
+        journal->lines(i, 1, {lines[i]});
+      }
+    }
+  }
+
+  /**
+   * Back to the file as read, every edit since dropped, recovered ones
+   * too. False when there is no such file to go back to: it was never
+   * read into lines or has been saved over since.
+   */
+  bool revert() {
+    if(!content || !content->complete || saver || content->identity != identity) {
+      return false;
+    }
+    index.reset();  // its worker takes the lock to stop
+    lock_guard<mutex> l(buf_w_lock);
+    size_t count = lines.size();
+    lines = content->lines;
+    sharing = true;
+    col_indexes.clear();
+    wrap_rows.clear();
+    if(highlight) {
+      highlight->lines_changed(0, count, lines.size());
+    }
+    history.clear();
+    if(journal) {
+      journal->discard();
+      journal.reset();
+      journal.reset(new edit_journal(edit_journal::free_path(identity), identity));
+    }
+    modified = false;
+    status = "reverted";
+    return true;
+  }
+
+  /**
+   * Break line idx in two at byte.
+   */
+  void split_line(size_t idx, int byte) {
+    x_line* line = lines[idx];
+    x_line* tail = make_line(line->data() + byte, line->size() - byte);
+    erase_text(idx, byte, line->size() - byte);
+    replace_lines(idx + 1, 0, {tail});
+  }
+
+  /**
+   * Append line idx + 1 to line idx.
+   */
+  void join_line(size_t idx) {
+    x_line* next = lines[idx + 1];
+    insert_text(idx, lines[idx]->size(), next->data(), next->size());
+    replace_lines(idx + 1, 1, {});
+  }
+
+  /**
+   * Start writing the buffer back to its file in the background.
+   */
+  bool save() {
+    if(saver) {
+      return false;
+    }
+    lock_guard<mutex> l(buf_w_lock);
+    edited_while_saving = false;
+    saver.reset(new buf_saver(file_path, lines, identity,
+                              has_identity, final_newline));
+    status = "saving";
+    return true;
+  }
+
+  /**
+   * Check on a running save, true when the mode line has news.
+   */
+  bool poll_save() {
+    if(!saver) {
+      return false;
+    }
+
+    int state = saver->state;
+    if(state == buf_saver::save_running) {
+      status = "saving " + to_string(saver->percent()) + "%";
+      return true;
+    }
+
+    if(state == buf_saver::save_done) {
+      lock_guard<mutex> l(buf_w_lock);
+      if(content && content.use_count() == 1) {
+        this->take_content();
+      }
+      // lines only the undo history holds were read from the old file
+      history.forget_disk();
+      // snapshot lines now live at new offsets, and unless they were
+      // edited meanwhile they hold what is there. Lines shared with
+      // other buffers never change: ours move to copies, those of the
+      // snapshot at their new offsets, the rest off the disk.
+      unordered_map<x_line*, x_line*> copies;
+      auto own = [&](x_line* line) -> x_line* {
+        if(!line->shared) {
+          return line;
+        }
+        x_line*& copy = copies[line];
+        if(!copy) {
+          copy = arena.make<x_line>(*line);
+          copy->shared = false;
+          copy->on_disk = false;
+        }
+        return copy;
+      };
+      for(size_t i = 0 ; i < saver->positions.size() ; i++) {
+        x_line* line = saver->line_at(i);
+        bool changed = changed_while_saving.count(line);
+        line = own(line);
+        line->file_position = saver->positions[i];
+        line->on_disk = !changed;
+      }
+      if(content) {
+        for(auto& line : lines) {
+          line = own(line);
+        }
+        history.relocate(own);
+      }
+      identity = saver->saved;
+      has_identity = true;
+      fsize = identity.size;
+      modified = edited_while_saving || !changed_while_saving.empty();
+      status = "saved";
+      rebase_journal(saver->get_lines());
+    } else {
+      status = "save failed, " + saver->get_error();
+    }
+    changed_while_saving.clear();
+    saver.reset();
+    return true;
+  }
+
+  /**
+   * Block until a running save is through, how it went.
+   */
+  save_outcome wait_save() {
+    if(!saver) {
+      return save_none;
+    }
+    saver->wait();
+    bool ok = saver->state == buf_saver::save_done;
+    poll_save();
+    return ok ? save_ok : save_error;
+  }
+
+  string get_status() {
+    return status;
+  }
+
+  /**
+   * Share of the lines the search index covers, in percent.
+   */
+  int index_percent() {
+    lock_guard<mutex> l(index_lock());
+    return search_index() ? search_index()->percent() : 0;
+  }
+
+  /**
+   * The search index over lines and the lock it is read under.
+   */
+  trigram_index* search_index() {
+    return sharing ? content->index.get() : index.get();
+  }
+
+  mutex& index_lock() {
+    return sharing ? content->lock : buf_w_lock;
+  }
+
+  /**
+   * Lines holding pattern, narrowed down by the trigram index where it
+   * can. Returns how many there are, the first limit go into out.
+   */
+  size_t find_lines(const string& pattern, vector<size_t>& out, size_t limit) {
+    trigram_index::candidates c;
+    if(search_index()) {
+      lock_guard<mutex> l(index_lock());
+      c = search_index()->lookup(pattern);
+    }
+    size_t n = 0;
+    auto check = [&](size_t i) {
+      if(memmem(lines[i]->data(), lines[i]->size(), pattern.data(), pattern.size())) {
+        if(n++ < limit) {
+          out.push_back(i);
+        }
+      }
+    };
+    if(c.usable) {
+      for(auto i : c.lines) {
+        check(i);
+      }
+    }
+    for(size_t i = c.usable ? c.scan_from : 0 ; i < lines.size() ; i++) {
+      check(i);
+    }
+    return n;
+  }
+
+  /**
+   * Lines built elsewhere live in arena, keep it for as long as the
+   * buffer.
+   */
+  void adopt(line_arena& other) {
+    arena.adopt(other);
+  }
+
+  void set_status(const string& text) {
+    status = text;
+  }
+};
+
+
+/**
+ * The buffers of an editor, owned: they go when the list goes.
+ */
+class buf_list {
+
+private:
+  vector<buf*> buffers;
+  buf* current_buffer = NULL;
+
+  // files read into lines, by what the file was when read.
+  map<file_identity, weak_ptr<buf_content>> contents;
+
+public:
+  buf_list() = default;
+
+  buf_list(buf* first):
+    current_buffer(first) {
+    this->buffers.push_back(first);
+  }
+
+  buf_list(const buf_list&) = delete;
+  buf_list& operator=(const buf_list&) = delete;
+
+  ~buf_list() {
+    for(auto b : buffers) {
+      delete b;
+    }
+  }
+
+  buf_list& append(buf* buffer) {
+    return this->append(*buffer);
+  }
+
+  buf_list& append(buf& buffer) {
+    this->buffers.push_back(&buffer);
+    this->current_buffer = &buffer;
+    return *this;
+  }
+
+  int num_buffers()  {
+    return this->buffers.size();
+  }
+
+  buf* get_current_buffer() {
+    return this->current_buffer;
+  }
+
+  const vector<buf*>& get_buffers() {
+    return this->buffers;
+  }
+
+  void set_current(buf* buffer) {
+    this->current_buffer = buffer;
+  }
+
+  buf* find(const string& name) {
+    for(auto b : buffers) {
+      if(b->get_buffer_name() == name) {
+        return b;
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * New buffer for the file at path, made current. A file already read
+   * by another buffer, same device, inode and mtime, is not read again:
+   * the buffers share its lines and each keeps its own point. With head
+   * only that many lines are read, see buf::finish_fill.
+   */
+  buf* open(const string& name, const string& path, size_t head = 0) {
+    file_identity id;
+    shared_ptr<buf_content> shared;
+    if(id.read(path)) {
+      auto it = contents.find(id);
+      if(it != contents.end() && !(shared = it->second.lock())) {
+        contents.erase(it);
+      } else if(shared && !shared->complete) {
+        shared.reset();
+      }
+    }
+
+    string unique = name;
+    for(int n = 2 ; find(unique) ; n++) {
+      unique = name + "<" + to_string(n) + ">";
+    }
+
+    buf* buffer = new buf(unique, path, shared, head);
+    shared_ptr<buf_content> read = buffer->get_content();
+    if(!shared && read) {
+      contents[read->identity] = read;
+    }
+    append(buffer);
+    return buffer;
+  }
+
+  /**
+   * The buffer opened before buffer, or after it when it is the first.
+   */
+  buf* other(buf* buffer) {
+    auto it = find_if(buffers.begin(), buffers.end(),
+                      [buffer](buf* b) { return b == buffer; });
+    if(it == buffers.end() || buffers.size() < 2) {
+      return NULL;
+    }
+    return (it == buffers.begin()) ? *(it + 1) : *(it - 1);
+  }
+
+  /**
+   * Drop buffer from the list, the caller owns it again.
+   */
+  void remove(buf* buffer) {
+    buffers.erase(std::remove(buffers.begin(), buffers.end(), buffer),
+                  buffers.end());
+    if(current_buffer == buffer) {
+      current_buffer = buffers.empty() ? NULL : buffers.back();
+    }
+  }
+
+};
+
+class display_window {
+
+private:
+  int num_lines;
+  int numColumns;
+  int beginY;
+  int beginX;
+
+  WINDOW* window;
+
+public:
+  // using managed resource window
+  display_window () = delete;
+  display_window& operator=(const display_window& ) = delete;
+
+  display_window(int nl, int nc,int by, int bx):
+     num_lines(nl)
+    ,numColumns(nc)
+    ,beginY(by)
+    ,beginX(bx) {
+
+    window = newwin(num_lines, numColumns,
+                    beginY, beginX);
+
+    // start with cursor at beginning
+    this->move_cursor(beginY,beginX);
+  }
+
+  int get_height() {
+    return num_lines;
+  };
+
+  int get_width() {
+    return numColumns;
+  };
+
+  void rewind() {
+    move_cursor(beginY,beginX);
+  }
+
+  display_window& refresh() {
+    wrefresh(window);
+    return *this;
+  }
+
+  display_window& move_cursor(int y, int x){
+    wmove(window,y,x);
+    wrefresh(window);
+    return *this;
+  }
+
+  display_window& display_line(int y, int x, const string& line) {
+    wmove(window,y,x);
+    waddnstr(window,line.c_str(),line.size());
+    wrefresh(window);
+    return *this;
+  }
+
+  /**
+   * Print line at (y, x), spans give the attribute from each offset on.
+   */
+  display_window& display_runs(int y, int x, const string& line,
+                               const vector<pair<size_t,int>>& spans) {
+    wmove(window,y,x);
+    if(spans.empty()) {
+      waddnstr(window,line.c_str(),line.size());
+    }
+    for(size_t i = 0 ; i < spans.size() ; i++) {
+      size_t end = (i + 1 < spans.size()) ? spans[i+1].first : line.size();
+      wattrset(window, COLOR_PAIR(spans[i].second));
+      waddnstr(window, line.c_str() + spans[i].first, end - spans[i].first);
+    }
+    wattrset(window, A_NORMAL);
+    wrefresh(window);
+    return *this;
+  }
+
+  display_window& display_line(string line) {
+    waddnstr(window,line.c_str(),line.size());
+    wrefresh(window);
+    return *this;
+  }
+
+  display_window& clear() {
+    wclear(window);
+    wmove(window,0,0);
+    wrefresh(window);
+    return *this;
+  }
+
+  string read_input(const string &prompt ) {
+    clear();
+    display_line(0,0,prompt);
+    char input[256];
+    echo();
+    wgetnstr(window, input, 256);
+    clear();
+    noecho();
+    return string(input);
+  }
+
+  ~display_window() {
+    delwin(window);
+  }
+};
+
+
+class editor;
+class editor_command;
+class mode;
+class Next_line;
+
+enum  editor_mode { command_mode = 0,
+                    insert_mode  = 1,
+                    search_mode  = 2,
+                    diff_mode    = 3,
+                    gz_mode      = 4,
+                    hex_mode     = 5 };
+
+typedef map<string,editor_command*> keymap;
+
+class x_mode {
+private:
+  string mode_name;
+  keymap mode_map;
+  editor_command* fallback;  // runs keys the map does not know
+
+public:
+  x_mode(const string& name, const keymap &cmds,
+         editor_command* fallback = nullptr) :
+     mode_name(name), mode_map(cmds), fallback(fallback){}
+
+  editor_command* lookup(const string& cmd) {
+    auto it = mode_map.find(cmd);
+    return it != mode_map.end() ? it->second : fallback;
+  }
+  string& get_name() { return mode_name; }
+};
+
+
+class editor_command {
+  friend class editor;
+  vector<string> keys;
+public:
+  editor_command() {};
+  editor_command(vector<string> & ks):keys(ks) {};
+
+  vector<string> & getKeys() {
+    return this->keys;
+  }
+
+  static void keymap_add( keymap& map, editor_command* ec);
+
+  virtual editor_mode operator() (editor &display, const string& cmd ) = 0;
+  ~editor_command() {}
+};
+
+void editor_command::keymap_add(keymap& map, editor_command* ec)
+{
+  for(auto &key : ec->getKeys()) {
+    map.insert({key,ec});
+  }
+}
+
+// TODO: auto-gen
+class move_pg : public editor_command {
+public:
+  move_pg(): editor_command() {};
+  move_pg(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd );
+};
+
+class search_fwd : public editor_command {
+public:
+  search_fwd(): editor_command() {};
+  search_fwd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd );
+};
+
+class open_file : public editor_command {
+public:
+  open_file(): editor_command() {};
+  open_file(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator() (editor& d, const string &cmd );
+};
+
+class mv_point : public editor_command {
+public:
+  mv_point(): editor_command() {};
+  mv_point(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class toggle : public editor_command {
+public:
+  toggle(): editor_command() {};
+  toggle(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class ins_mode : public editor_command {
+public:
+  ins_mode(): editor_command() {};
+  ins_mode(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class self_insert : public editor_command {
+public:
+  self_insert(): editor_command() {};
+  self_insert(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class save_buf : public editor_command {
+public:
+  save_buf(): editor_command() {};
+  save_buf(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class filter_cmd : public editor_command {
+public:
+  filter_cmd(): editor_command() {};
+  filter_cmd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class buffers_cmd : public editor_command {
+public:
+  buffers_cmd(): editor_command() {};
+  buffers_cmd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class hex_cmd : public editor_command {
+public:
+  hex_cmd(): editor_command() {};
+  hex_cmd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class gz_cmd : public editor_command {
+public:
+  gz_cmd(): editor_command() {};
+  gz_cmd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class diff_cmd : public editor_command {
+public:
+  diff_cmd(): editor_command() {};
+  diff_cmd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class undo_cmd : public editor_command {
+public:
+  undo_cmd(): editor_command() {};
+  undo_cmd(vector<string> & ks): editor_command(ks) {};
+  editor_mode operator()(editor& d, const string &cmd);
+};
+
+class editor {
+
+private:
+  vector<x_mode*> modes;
+
+  int screen_height = 0;
+  int screen_width  = 0;
+
+  int mode_padding = 1;
+  editor_mode mode = command_mode;
+
+  display_window *mode_window = NULL;
+  display_window *buffer_window = NULL;
+
+  buf_list *buffers;
+
+  bool redisplay = false; // trigger a buffer-redisplay of buffer
+  bool quit = false;      // quit will cause the display loop to exit.
+
+  typedef pair<int,int> point;
+
+  point cursor;
+  int   start_line = 0;
+  int   start_col  = 0;   // first visible column, horizontal scroll
+  int   start_row  = 0;   // first visible wrapped row of start_line
+
+  // (line, wrapped row) shown on each screen row when soft wrapping.
+  vector<pair<size_t,int>> screen_rows;
+
+  string last_search;  // repeated by "n"
+
+  vector<string> startup_files;  // opened by start()
+
+  deque<string> script_input;  // answers to prompts when headless
+
+  // side by side diff of the current buffer (left) and diff_other
+  struct diff_row {
+    long a;        // line on the left, -1 for none
+    long b;        // line on the right, -1 for none
+    bool changed;
+  };
+  buf* diff_other = NULL;
+  vector<diff_row> diff_rows;
+  vector<size_t> diff_hunks;  // row each hunk starts at
+  size_t diff_top = 0;
+
+  // first line shown of a compressed buffer
+  size_t gz_top = 0;
+
+  // hex view: first row shown and the bytes last found
+  size_t hex_top = 0;
+  uint64_t hex_found = 0;
+  size_t hex_found_len = 0;
+  string hex_pattern;
+  const static int gz_row_bytes = col_index::wide_line - 1;  // no col_index for these
+
+  // what each line of the search results buffer points at
+  const static size_t max_hits = 1000;  // listed per buffer
+  buf* results = NULL;
+  vector<pair<buf*,size_t>> result_hits;
+
+  const static int gutter_width = 7;  // "%5d: " line numbers
+  const static int poll_interval = 100;  // ms between background checks
+
+public:
+  bool line_number_show = false;
+  bool soft_wrap = false;
+
+  enum move_dir { move_y = 0 , move_x };
+  enum anchor_type { no_anchor = 0 ,
+                     file_begin,
+                     file_end,
+                     line_begin,
+                     line_end,
+                     page_begin,
+                     page_end};
+
+  editor() : buffers(new buf_list()) { }
+
+  /**
+   * Start ncurses
+   */
+  void init() {
+    // pick up a UTF-8 locale so multibyte characters reach the terminal
+    setlocale(LC_ALL, "");
+
+    // determine the screen
+    initscr();
+
+    // initialized the screen_height and screen_width
+    getmaxyx(stdscr, this->screen_height, this->screen_width);
+
+    this->mode_window    =
+      new display_window(screen_height-1,
+                        screen_width,
+                        screen_height-mode_padding, // beginY
+                        0);
+
+    this->buffer_window  =
+      new display_window(screen_height- mode_padding, // num lines
+                        screen_width,                 // num cols
+                        0,                            // beginY
+                        0);                           // beginX
+
+    if(has_colors()) {
+      start_color();
+      use_default_colors();
+      init_pair(hl_keyword, COLOR_YELLOW,  -1);
+      init_pair(hl_string,  COLOR_GREEN,   -1);
+      init_pair(hl_number,  COLOR_MAGENTA, -1);
+      init_pair(hl_comment, COLOR_CYAN,    -1);
+      init_pair(hl_preproc, COLOR_BLUE,    -1);
+      init_pair(hl_key,     COLOR_BLUE,    -1);
+      init_pair(hl_error,   COLOR_RED,     -1);
+      init_pair(hl_warning, COLOR_YELLOW,  -1);
+      init_pair(hl_time,    COLOR_CYAN,    -1);
+    }
+
+    // wake up now and then to pick up background work
+    timeout(poll_interval);
+
+    raw();
+  }
+
+  /**
+   * Run without a terminal: no windows, commands act as on a rows by
+   * cols screen and prompts are answered from script_input.
+   */
+  void init_headless(int rows, int cols) {
+    this->screen_height = rows + mode_padding;
+    this->screen_width = cols;
+    this->build_modes();
+  }
+
+  bool headless() {
+    return this->buffer_window == NULL;
+  }
+
+  void build_modes() {
+    keymap cmd_map;
+    keymap search_map;
+
+    vector<string> mv_point_keys {"j","^n","k",
+                                  "^p" ,"^","0",
+                                  "$","l","h","G",
+                                  "^b","^f",
+                                  "^a","^e",
+                                  "H","L","|"};
+
+    editor_command::keymap_add(cmd_map,new mv_point(mv_point_keys));
+
+    vector<string> move_pg_keys {">","<"," ","^v", "^V"};
+    editor_command::keymap_add(cmd_map,new move_pg(move_pg_keys));
+
+    vector<string> toggle_keys {".","w"};
+    editor_command::keymap_add(cmd_map,new toggle(toggle_keys));
+
+    vector<string> buffer_keys {"o"};
+    editor_command::keymap_add(cmd_map,new open_file(buffer_keys));
+
+    vector<string> search_fwd_keys {"^s","/","n","%"};
+    editor_command::keymap_add(cmd_map,new search_fwd(search_fwd_keys));
+
+
+    vector<string> ins_mode_keys {"i"};
+    editor_command::keymap_add(cmd_map,new ins_mode(ins_mode_keys));
+
+    vector<string> save_keys {"W"};
+    editor_command::keymap_add(cmd_map,new save_buf(save_keys));
+
+    vector<string> undo_keys {"u","^r","R"};
+    editor_command::keymap_add(cmd_map,new undo_cmd(undo_keys));
+
+    vector<string> filter_keys {"!"};
+    editor_command::keymap_add(cmd_map,new filter_cmd(filter_keys));
+
+    vector<string> buffers_keys {"A","B","^m","^j"};
+    editor_command::keymap_add(cmd_map,new buffers_cmd(buffers_keys));
+
+    vector<string> diff_keys {"D"};
+    editor_command::keymap_add(cmd_map,new diff_cmd(diff_keys));
+
+    keymap diff_map;
+    vector<string> diff_view_keys {"j","^n","k","^p",
+                                   " ",">","^v","<",
+                                   "n","N","\x1b"};
+    editor_command::keymap_add(diff_map,new diff_cmd(diff_view_keys));
+
+    keymap gz_map;
+    vector<string> gz_view_keys {"j","^n","k","^p",
+                                 " ",">","^v","<",
+                                 "G","B"};
+    editor_command::keymap_add(gz_map,new gz_cmd(gz_view_keys));
+
+    vector<string> hex_keys {"X"};
+    editor_command::keymap_add(cmd_map,new hex_cmd(hex_keys));
+
+    keymap hex_map;
+    vector<string> hex_view_keys {"j","^n","k","^p",
+                                  " ",">","^v","<",
+                                  "G","g","/","n","B","\x1b"};
+    editor_command::keymap_add(hex_map,new hex_cmd(hex_view_keys));
+
+    keymap ins_map;
+
+    this->modes.push_back(new x_mode(mode_name(command_mode), cmd_map));
+    this->modes.push_back(new x_mode(mode_name(insert_mode), ins_map, new self_insert()));
+    this->modes.push_back(new x_mode(mode_name(search_mode), search_map));
+    this->modes.push_back(new x_mode(mode_name(diff_mode), diff_map));
+    this->modes.push_back(new x_mode(mode_name(gz_mode), gz_map));
+    this->modes.push_back(new x_mode(mode_name(hex_mode), hex_map));
+    this->mode = command_mode;
+  }
+
+  int get_currrent_line_idx() {
+    if(soft_wrap) {
+      layout_screen();
+      if(screen_rows.empty()) {
+        return this->start_line;
+      }
+      return screen_rows[min(size_t(cursor.first), screen_rows.size() - 1)].first;
+    }
+    return
+      this->start_line + this->cursor.first;
+  }
+
+  x_line* get_current_line() {
+    int idx = this->get_currrent_line_idx();
+    return this->get_current_buffer()->get_line(idx);
+  }
+
+  x_mode* get_current_mode() {
+    return this->modes[mode];
+  }
+
+  /**
+   * Name of m for the mode line, known before the keymaps are built.
+   */
+  static const char* mode_name(editor_mode m) {
+    static const char* names[] = {"CMD", "INSERT", "SEARCH", "DIFF", "GZ", "HEX"};
+    return names[m];
+  }
+
+  void change_mode(editor_mode newMode) {
+    // compressed files have nothing but their read only view
+    if(newMode == command_mode && this->get_current_buffer()->get_compressed()) {
+      newMode = gz_mode;
+    }
+    if(newMode == command_mode && this->get_current_buffer()->is_binary()) {
+      newMode = hex_mode;
+    }
+    if(newMode!= mode){
+      mode = newMode;
+      if(mode == hex_mode) {
+        hex_status("");
+      }
+    }
+  }
+
+  void run_cmd(const string& cmd) {
+    if(cmd == "q") { // treat quit special for nwo
+      this->quit = true;
+    }else if(!cmd.empty()) { // Need to look up command in the mode
+
+      // don't do redisplay unless requested
+      this->redisplay = false;
+
+      x_mode* mode = this->get_current_mode();
+
+      if (!mode)
+        return;
+
+      editor_command* editor_command = mode->lookup(cmd);
+      if(!editor_command)
+        return;
+
+      this->get_current_buffer()->undo_boundary();
+      editor_mode nextMode = (*editor_command)(*this,cmd);
+      this->change_mode(nextMode);
+    }
+  }
+
+  void display_mode_line() {
+
+    buf* current_buffer =
+      this->buffers->get_current_buffer();
+
+    string modified =
+      current_buffer->is_modified() ? "*" : "-";
+
+    stringstream mode_line;
+    mode_line<<"["<<modified<<"] "<< current_buffer->get_buffer_name()
+            <<" ------ " << "["<< mode_name(this->mode) <<"]"
+            <<"  "<< current_buffer->get_status();
+
+    // pad so a shorter line wipes the previous one
+    string text = mode_line.str();
+    text.resize(max(int(text.size()), this->mode_window->get_width() - 1), ' ');
+
+    // rpait mode at 0 0
+    this->mode_window->display_line(0, 0, text);
+  }
+
+  string mode_read_input(const string & prompt) {
+    if(headless()) {
+      string input;
+      if(!script_input.empty()) {
+        input = script_input.front();
+        script_input.pop_front();
+      }
+      return input;
+    }
+    string input =  this->mode_window->read_input(prompt);
+    this->mode_window->display_line(0,0,input);
+    return input;
+  }
+
+  buf* get_current_buffer() {
+    return this->buffers->get_current_buffer();
+  }
+
+  void display_buffer() {
+    //app::get_logger().log("display_buffer");
+
+    this->buffer_window->clear();
+    this->buffer_window->rewind();
+
+    if(this->mode == diff_mode) {
+      display_diff();
+      return;
+    }
+    if(this->mode == gz_mode) {
+      display_compressed();
+      return;
+    }
+    if(this->mode == hex_mode) {
+      display_hex();
+      return;
+    }
+
+    buf* buffer =
+      this->buffers->get_current_buffer();
+
+    vector<x_line*> & lines = buffer->get_lines();
+
+    int width = this->text_width();
+
+    if(soft_wrap) {
+      layout_screen();
+      for(size_t row = 0 ; row < screen_rows.size() ; row++) {
+        size_t line_count = screen_rows[row].first;
+        int wrapped = screen_rows[row].second;
+
+        if(line_number_show && wrapped == 0) {
+          char ls[256];
+          sprintf(ls,"%5d: ",int(line_count));
+          this->buffer_window->display_line(row, 0, string(ls));
+        }
+        this->display_row(row, line_count, wrapped * width, width);
+      }
+      this->buffer_window->rewind();
+      return;
+    }
+
+    for(size_t line_count = start_line ; line_count < lines.size() ; line_count++) {
+
+      int row = line_count - start_line;
+      if(row >= this->buffer_window->get_height()) {
+        break;
+      }
+
+      // iterate through the lines going to cursor poistion
+      if(line_number_show){
+        char ls[256];
+        sprintf(ls,"%5d: ",int(line_count));
+        this->buffer_window->display_line(row, 0, string(ls));
+      }
+
+      this->display_row(row, line_count, start_col, width);
+    }
+    // rewind to beginning -
+    this->buffer_window->rewind();
+  }
+
+  /**
+   * box value withing limits with included
+   * padding.
+   */
+  int box(int value,
+          pair<int,int>  limits,
+          pair<int,int>  padding) {
+
+    int min = limits.first  - padding.first;
+    int max = limits.second - padding.second;
+
+    if(value  >= max)
+      return max;
+    else if(value <= min) {
+      return min;
+    } else {
+      return value;
+    }
+  }
+
+  point make_point(int y, int x){
+    return make_pair(y,x);
+  }
+
+  int gutter() {
+    return line_number_show ? gutter_width : 0;
+  }
+
+  int text_width() {
+    return max(1, view_width() - gutter());
+  }
+
+  int view_height() {
+    return headless() ? screen_height - mode_padding : buffer_window->get_height();
+  }
+
+  int view_width() {
+    return headless() ? screen_width : buffer_window->get_width();
+  }
+
+  /**
+   * Draw columns from .. from + width of line idx on screen row row,
+   * only that slice of the line is ever formatted.
+   */
+  void display_row(int row, size_t idx, int from, int width) {
+    buf* buffer = this->get_current_buffer();
+    vector<attr_run> runs;
+    vector<pair<size_t,int>> spans;
+
+    buffer->line_attrs(idx, runs);
+    string text = this->visible_slice(buffer->get_line(idx), from, width,
+                                      runs, spans);
+    this->buffer_window->display_runs(row, this->gutter(), text, spans);
+  }
+
+  /**
+   * Text of line as it shows between columns from and from + width.
+   * Long lines seek through their col_index, so only the visible
+   * slice is ever looked at. spans receives the output offsets where
+   * the highlight attribute from runs changes.
+   */
+  string visible_slice(x_line* line, int from, int width,
+                       const vector<attr_run>& runs,
+                       vector<pair<size_t,int>>& spans,
+                       buf* owner = NULL) {
+    const char* text = line->data();
+    int len = line->size();
+    x_line::text_type type = line->get_text_type();
+    int column;
+    int byte = column_byte(line, from, column, owner);
+
+    auto run = lower_bound(runs.begin(), runs.end(), byte,
+                           [](const attr_run& r, int b) { return r.end <= b; });
+    int attr = -1;
+
+    string out;
+    int end = from + width;
+    while(byte < len && column < end) {
+      int w;
+      int n = col_index::char_at(text, len, byte, column, type, w);
+      unsigned char c = text[byte];
+
+      while(run != runs.end() && run->end <= byte) {
+        run++;
+      }
+      int a = (run != runs.end() && run->start <= byte) ? run->attr : hl_plain;
+      if(a != attr) {
+        spans.push_back({out.size(), a});
+        attr = a;
+      }
+
+      if(c >= 0x80 && column >= from && column + w <= end) {
+        uint32_t cp;
+        utf8::decode(text, len, byte, cp, type == x_line::text_utf8);
+        if(cp == utf8::bad) {
+          out += '?';
+        } else {
+          if(utf8::width(cp) == 0) { // lone mark, give it something to sit on
+            out += ' ';
+          }
+          out.append(text + byte, n);
+        }
+      } else {
+        for(int k = 0 ; k < w ; k++) {
+          int col = column + k;
+          if(col < from || col >= end) {
+            continue;
+          }
+          if(c == '\t' || c >= 0x80) { // tab or wide character cut by an edge
+            out += ' ';
+          } else if(c < 32 || c == 127) {
+            out += (k == 0) ? '^' : char(c ^ 64);
+          } else {
+            out += c;
+          }
+        }
+      }
+      column += w;
+      byte += n;
+    }
+    return out;
+  }
+
+  /**
+   * Byte of the character covering column col of line, start receives
+   * the column it begins at. The line is in owner, by default the
+   * current buffer.
+   */
+  int column_byte(x_line* line, int col, int& start, buf* owner = NULL) {
+    x_line::text_type type = line->get_text_type();
+    col_index* idx = (owner ? owner : this->get_current_buffer())->get_col_index(line);
+    int byte = 0;
+    start = 0;
+    if(idx) {
+      byte = idx->byte_at(line->data(), line->size(), type, col, start);
+    } else {
+      col_index::scan(line->data(), line->size(), type, col, start, byte);
+    }
+    return byte;
+  }
+
+  /**
+   * Column of the character inc characters away from the one covering
+   * col, without leaving the line.
+   */
+  int step_column(x_line* line, int col, int inc) {
+    int start;
+    int byte = column_byte(line, col, start);
+    int len = line->size();
+
+    for(; inc > 0 && byte < len ; inc--) {
+      int w;
+      byte += col_index::char_at(line->data(), len, byte, start,
+                                 line->get_text_type(), w);
+      if(byte >= len) {
+        break;
+      }
+      start += w;
+    }
+    for(; inc < 0 && start > 0 ; inc++) {
+      byte = column_byte(line, start - 1, start);
+    }
+    return start;
+  }
+
+  /**
+   * Scroll horizontally so that line column col is visible, returns
+   * the window column it ends up in.
+   */
+  int scroll_to_column(int col) {
+    int width = this->text_width();
+    if(col < start_col || col >= start_col + width) {
+      start_col = max(0, col - width / 2);
+      mark_redisplay();
+    }
+    return col - start_col;
+  }
+
+  /**
+   * Shift the view inc columns, the point stays on the same line
+   * column while that is still visible.
+   */
+  void scroll_columns(int inc) {
+    if(soft_wrap) {
+      return;
+    }
+    int width = this->text_width();
+    int col = start_col + cursor.second;
+
+    start_col = max(0, start_col + inc);
+    col = box(col, {start_col, start_col + width}, {0, 1});
+    cursor = make_point(cursor.first, col - start_col);
+    mark_redisplay();
+  }
+
+  void goto_column(int col) {
+    x_line* line = this->get_current_line();
+    if(line) {
+      col = step_column(line, box(col, {0, get_line_size() + 1}, {0, 1}), 0);
+      if(soft_wrap) {
+        place_wrapped(get_currrent_line_idx(), col);
+      } else {
+        cursor = make_point(cursor.first, scroll_to_column(col));
+      }
+    }
+  }
+
+  point bol() {
+    return make_pair(cursor.first, -start_col);
+  }
+
+  point bof() {
+    return make_pair(0,0);
+  }
+
+  point eof() {
+    return make_pair(this->get_current_buffer()->get_lines().size(),0);
+  }
+
+  point eol() {
+    return make_pair(cursor.first, get_line_size() - start_col);
+  }
+
+  /**
+   * Display columns taken by line.
+   */
+  int get_line_columns(x_line* cur) {
+    return this->get_current_buffer()->line_columns(cur);
+  }
+
+  /**
+   * Column where the last character of the line starts.
+   */
+  int get_line_size(size_t idx) {
+    x_line* cur = this->get_current_buffer()->get_line(idx);
+    if(cur) {
+      int start;
+      column_byte(cur, get_line_columns(cur) - 1, start);
+      return start;
+    }
+    return 0;
+  }
+
+  int get_line_size() {
+    return get_line_size(get_currrent_line_idx());
+  }
+
+  /**
+   * Points are window relative, their column may fall outside the
+   * window in which case we scroll to it.
+   */
+  point inc_point(point p, int inc, move_dir dir)
+  {
+    if(dir == move_y) {
+      int row = box(p.first+inc,
+                    {0, view_height()},
+                    {0, this->mode_padding});
+      x_line* line = this->get_current_buffer()->get_line(start_line + row);
+      int col = 0;
+      if(line) { // land on the start of the character under the column
+        col = step_column(line, min(this->get_line_size(start_line + row)+1,
+                                    start_col + p.second), 0);
+      }
+      return make_point(row, scroll_to_column(col));
+    } else if(dir == move_x) { // step by characters, not bytes or columns
+      x_line* line = this->get_current_buffer()->get_line(start_line + p.first);
+      int col = 0;
+      if(line) {
+        col = min(step_column(line, max(start_col + p.second, 0), inc),
+                  this->get_line_size(start_line + p.first));
+      }
+      return make_point(p.first, scroll_to_column(col));
+    } else{
+      return cursor;
+    }
+  }
+
+  void move_point(int inc, move_dir dir, anchor_type anchor ) {
+    if(soft_wrap) {
+      move_wrapped(inc, dir, anchor);
+      return;
+    }
+
+    // compute increment relative to anchor
+    if(anchor == no_anchor) {
+      this->cursor = inc_point(cursor,inc,dir);
+    } else if (anchor == line_begin) {
+      this->cursor = inc_point(bol(),inc, editor::move_x);
+    } else if (anchor == line_end) {
+      this->cursor = inc_point(eol(),inc, editor::move_x);
+    } else if (anchor == file_begin) {
+      this->cursor = inc_point(bof(),inc,editor::move_y);
+    } else if (anchor == file_end) {
+      this->cursor = inc_point(eof(),inc,editor::move_y);
+    }
+
+    else  {
+      return;
+    }
+  }
+
+  /**
+   * Fill screen_rows from (start_line, start_row) using the cached
+   * wrapped row counts, only the lines on screen are measured.
+   */
+  void layout_screen() {
+    buf* buffer = this->get_current_buffer();
+    size_t nlines = buffer->get_lines().size();
+    size_t height = view_height();
+    int width = this->text_width();
+
+    screen_rows.clear();
+    size_t line = start_line;
+    int row = start_row;
+    while(screen_rows.size() < height && line < nlines) {
+      screen_rows.push_back({line, row});
+      if(++row >= buffer->visual_rows(buffer->get_line(line), width)) {
+        line++;
+        row = 0;
+      }
+    }
+  }
 
-  editor() : buffers(new buf_list()) { }
+  /**
+   * Move the top of the view n wrapped rows, each step costs at most
+   * one cached row count.
+   */
+  void scroll_rows(int n) {
+    buf* buffer = this->get_current_buffer();
+    size_t nlines = buffer->get_lines().size();
+    int width = this->text_width();
+
+    while(n > 0 && size_t(start_line) < nlines) {
+      int rows = buffer->visual_rows(buffer->get_line(start_line), width);
+      int left = rows - 1 - start_row;
+      if(n <= left) {
+        start_row += n;
+        n = 0;
+      } else if(size_t(start_line) + 1 >= nlines) {
+        start_row = rows - 1;
+        n = 0;
+      } else {
+        n -= left + 1;
+        start_line++;
+        start_row = 0;
+      }
+    }
+    while(n < 0) {
+      if(start_row >= -n) {
+        start_row += n;
+        n = 0;
+      } else if(start_line == 0) {
+        start_row = 0;
+        n = 0;
+      } else {
+        n += start_row + 1;
+        start_line--;
+        start_row = buffer->visual_rows(buffer->get_line(start_line), width) - 1;
+      }
+    }
+    mark_redisplay();
+  }
 
   /**
-   * Start ncurses
+   * Put the cursor on column col of line idx, scrolling the wrapped
+   * view just enough to show it.
    */
-  void init() {
-    // determine the screen
-    initscr();
+  void place_wrapped(size_t idx, int col) {
+    int width = this->text_width();
+    int height = view_height();
+    int row = col / width;
+
+    layout_screen();
+    for(size_t i = 0 ; i < screen_rows.size() ; i++) {
+      if(screen_rows[i] == make_pair(idx, row)) {
+        cursor = make_point(i, col - row * width);
+        return;
+      }
+    }
 
-    // initialized the screen_height and screen_width
-    getmaxyx(stdscr, this->screen_height, this->screen_width);
+    if(idx < size_t(start_line) || (idx == size_t(start_line) && row < start_row)) {
+      start_line = idx;
+      start_row = row;
+      cursor = make_point(0, col - row * width);
+    } else {
+      start_line = idx;
+      start_row = row;
+      scroll_rows(-(height - 1));
+      layout_screen();
+      cursor = make_point(screen_rows.size() - 1, col - row * width);
+      for(size_t i = 0 ; i < screen_rows.size() ; i++) {
+        if(screen_rows[i] == make_pair(idx, row)) {
+          cursor = make_point(i, col - row * width);
+        }
+      }
+    }
+    mark_redisplay();
+  }
 
-    this->mode_window    =
-      new display_window(screen_height-1,
-                        screen_width,
-                        screen_height-mode_padding, // beginY
-                        0);
+  /**
+   * Cursor motion over wrapped rows: vertical steps go by screen row,
+   * horizontal ones by character and may cross into the next row.
+   */
+  void move_wrapped(int inc, move_dir dir, anchor_type anchor) {
+    buf* buffer = this->get_current_buffer();
+    int width = this->text_width();
+
+    if(anchor == file_begin) {
+      start_line = 0;
+      start_row = 0;
+      cursor = make_point(0, 0);
+      mark_redisplay();
+    }
 
-    this->buffer_window  =
-      new display_window(screen_height- mode_padding, // num lines
-                        screen_width,                 // num cols
-                        0,                            // beginY
-                        0);                           // beginX
+    layout_screen();
+    if(screen_rows.empty()) {
+      return;
+    }
 
-    keymap cmd_map;
-    keymap search_map;
+    int row = box(cursor.first, {0, int(screen_rows.size())}, {0, 1});
+    if(dir == move_y && anchor != line_begin && anchor != line_end) {
+      row = (anchor == file_end) ? screen_rows.size() - 1 :
+        box(row + inc, {0, int(screen_rows.size())}, {0, 1});
+    }
 
-    vector<string> mv_point_keys {"j","^n","k",
-                                  "^p" ,"^","0",
-                                  "$","l","h","G",
-                                  "^b","^f",
-                                  "^a","^e"};
+    size_t idx = screen_rows[row].first;
+    x_line* line = buffer->get_line(idx);
+    int col = screen_rows[row].second * width + cursor.second;
+
+    if(anchor == line_begin) {
+      col = step_column(line, 0, inc);
+    } else if(anchor == line_end) {
+      col = get_line_size(idx);
+    } else if(dir == move_x) {
+      col = min(step_column(line, col, inc), get_line_size(idx));
+    } else { // land on the start of the character under the column
+      col = step_column(line, min(get_line_size(idx) + 1, col), 0);
+    }
+    place_wrapped(idx, col);
+  }
 
-    editor_command::keymap_add(cmd_map,new mv_point(mv_point_keys));
+  void move_page(int pg_inc) {
+    if(soft_wrap) {
+      scroll_rows(pg_inc * view_height());
+      return;
+    }
 
-    vector<string> move_pg_keys {">","<"," ","^v", "^V"};
-    editor_command::keymap_add(cmd_map,new move_pg(move_pg_keys));
+    int max_lines =
+      this->get_current_buffer()->get_lines().size();
 
-    vector<string> toggle_keys {"."};
-    editor_command::keymap_add(cmd_map,new toggle(toggle_keys));
+    int pg_size =
+      view_height();
 
-    vector<string> buffer_keys {"o"};
-    editor_command::keymap_add(cmd_map,new open_file(buffer_keys));
+    int new_start_line =
+      this->start_line + (pg_inc * screen_height);
 
-    vector<string> search_fwd_keys {"^s","/"};
-    editor_command::keymap_add(cmd_map,new search_fwd(search_fwd_keys));
+    if(new_start_line <= 0 ) {
+      this->start_line = 0;
+    } else if(new_start_line >= max_lines){
+      this->start_line = max_lines - pg_size;
+    }  else {
+      this->start_line = new_start_line;
+    }
 
+    mark_redisplay();
+  }
 
-    this->modes.push_back(new x_mode("CMD", cmd_map));
-    //    this->modes.push_back(new x_mode("INSERT", ins_map));
-    this->modes.push_back(new x_mode("SEARCH", search_map));
-    this->mode = command_mode;
-    raw();
-    refresh();
+  void mark_redisplay() {
+    this->redisplay = true;
   }
 
-  int get_currrent_line_idx() {
-    return
-      this->start_line + this->cursor.first;
+  /**
+   * Column of the point within its line.
+   */
+  int point_column() {
+    if(soft_wrap) {
+      layout_screen();
+      if(screen_rows.empty()) {
+        return 0;
+      }
+      int row = min(size_t(cursor.first), screen_rows.size() - 1);
+      return screen_rows[row].second * text_width() + cursor.second;
+    }
+    return start_col + cursor.second;
   }
 
-  x_line* get_current_line() {
-    int idx = this->get_currrent_line_idx();
-    return this->get_current_buffer()->get_line(idx);
+  /**
+   * Put the point on column col of line idx, scrolling to it.
+   */
+  void set_point(size_t idx, int col) {
+    if(soft_wrap) {
+      place_wrapped(idx, col);
+      return;
+    }
+    int height = view_height();
+    if(idx < size_t(start_line)) {
+      start_line = idx;
+      mark_redisplay();
+    } else if(idx >= size_t(start_line + height)) {
+      start_line = idx - height + 1;
+      mark_redisplay();
+    }
+    cursor = make_point(idx - start_line, scroll_to_column(col));
   }
 
-  x_mode* get_current_mode() {
-    return this->modes[mode];
+  /**
+   * Line and byte under the point, nullptr in an empty buffer.
+   */
+  x_line* point_position(size_t& idx, int& byte, int& col) {
+    buf* buffer = this->get_current_buffer();
+    if(buffer->get_lines().empty()) {
+      idx = 0;
+      byte = col = 0;
+      return nullptr;
+    }
+    idx = min(size_t(get_currrent_line_idx()), buffer->get_lines().size() - 1);
+    x_line* line = buffer->get_line(idx);
+    byte = column_byte(line, point_column(), col);
+    return line;
   }
 
-  void change_mode(editor_mode newMode) {
-    if(newMode!= mode){
-      mode = newMode;
+  /**
+   * Give an empty buffer its first line, for text typed into it.
+   */
+  void first_line() {
+    buf* buffer = this->get_current_buffer();
+    if(buffer->get_lines().empty()) {
+      buffer->replace_lines(0, 0, {buffer->make_line("", 0)});
     }
   }
 
-  void run_cmd(const string& cmd) {
-    if(cmd == "q") { // treat quit special for nwo
-      this->quit = true;
-    }else { // Need to look up command in the mode
+  /**
+   * Insert text at the point, the point moves past it.
+   */
+  void insert_at_point(const string& text) {
+    size_t idx;
+    int byte, col;
+    first_line();
+    point_position(idx, byte, col);
+
+    // the edit may put a copy of the line in its place
+    buf* buffer = this->get_current_buffer();
+    buffer->insert_text(idx, byte, text.data(), text.size());
+    x_line* line = buffer->get_line(idx);
+
+    x_line::text_type type = line->get_text_type();
+    for(int b = byte ; b < byte + int(text.size()) ; ) {
+      int w;
+      b += col_index::char_at(line->data(), line->size(), b, col, type, w);
+      col += w;
+    }
+    set_point(idx, col);
+    mark_redisplay();
+  }
 
-      // don't do redisplay unless requested
-      this->redisplay = false;
+  /**
+   * Diff the current buffer against the one called name, the buffer
+   * opened before it when name is empty, and show the two side by side.
+   */
+  bool start_diff(const string& name) {
+    buf* left = this->get_current_buffer();
+    buf* right = name.empty() ? this->buffers->other(left) : this->buffers->find(name);
+    if(!right || right == left) {
+      left->set_status(name.empty() ? "diff: open another buffer first"
+                                    : "diff: no buffer " + name);
+      return false;
+    }
 
-      x_mode* mode = this->get_current_mode();
+    line_diff diff(left->get_lines(), right->get_lines());
+    diff_rows.clear();
+    diff_hunks.clear();
+    size_t removed = 0, added = 0;
+    long i = 0, j = 0;
+    auto same_until = [&](long a_end) {
+      for( ; i < a_end ; i++, j++) {
+        diff_rows.push_back({i, j, false});
+      }
+    };
+    for(auto& h : diff.get_hunks()) {
+      same_until(h.a);
+      diff_hunks.push_back(diff_rows.size());
+      size_t rows = max(h.a_len, h.b_len);
+      for(size_t r = 0 ; r < rows ; r++) {
+        diff_rows.push_back({r < h.a_len ? long(h.a + r) : -1,
+                             r < h.b_len ? long(h.b + r) : -1, true});
+      }
+      i = h.a + h.a_len;
+      j = h.b + h.b_len;
+      removed += h.a_len;
+      added += h.b_len;
+    }
+    same_until(left->get_lines().size());
 
-      if (!mode)
-        return;
+    diff_other = right;
+    diff_top = diff_hunks.empty() ? 0 : diff_hunks[0];
+    left->set_status("diff " + right->get_buffer_name() + ": " +
+                     to_string(diff_hunks.size()) + " hunks, -" +
+                     to_string(removed) + " +" + to_string(added));
+    mark_redisplay();
+    return true;
+  }
 
-      editor_command* editor_command = mode->lookup(cmd);
-      if(!editor_command)
-        return;
+  /**
+   * Scroll the diff by rows, or to the next (previous) hunk.
+   */
+  void scroll_diff(long rows) {
+    long last = max(0L, long(diff_rows.size()) - view_height());
+    diff_top = max(0L, min(last, long(diff_top) + rows));
+    mark_redisplay();
+  }
 
-      editor_mode nextMode = (*editor_command)(*this,cmd);
-      this->change_mode(nextMode);
+  void next_hunk(int dir) {
+    auto it = (dir > 0) ?
+      upper_bound(diff_hunks.begin(), diff_hunks.end(), diff_top) :
+      lower_bound(diff_hunks.begin(), diff_hunks.end(), diff_top);
+    if(dir > 0 && it != diff_hunks.end()) {
+      diff_top = *it;
+    } else if(dir < 0 && it != diff_hunks.begin()) {
+      diff_top = *(it - 1);
     }
+    mark_redisplay();
   }
 
-  void display_mode_line() {
-
-    buf* current_buffer =
-      this->buffers->get_current_buffer();
-
-    string modified =
-      current_buffer->is_modified() ? "*" : "-";
-
-    stringstream mode_line;
-    mode_line<<"["<<modified<<"] "<< current_buffer->get_buffer_name()
-            <<" ------ " << "["<< this->get_current_mode()->get_name() <<"]";
+  void end_diff() {
+    diff_other = NULL;
+    diff_rows.clear();
+    diff_rows.shrink_to_fit();
+    diff_hunks.clear();
+    this->get_current_buffer()->set_status("");
+    mark_redisplay();
+  }
 
-    // rpait mode at 0 0
-    this->mode_window->display_line(0, 0, mode_line.str());
+  /**
+   * Left half the current buffer, right half the other one; changed
+   * rows are marked - and + and colored.
+   */
+  void display_diff() {
+    int half = (view_width() - 1) / 2;
+    buf* sides[2] = { this->get_current_buffer(), diff_other };
+    for(int row = 0 ; row < view_height() &&
+          diff_top + row < diff_rows.size() ; row++) {
+      const diff_row& d = diff_rows[diff_top + row];
+      long idx[2] = { d.a, d.b };
+      for(int side = 0 ; side < 2 ; side++) {
+        if(idx[side] < 0) {
+          continue;
+        }
+        string out = !d.changed ? "  " : (side == 0 ? "- " : "+ ");
+        vector<pair<size_t,int>> spans, ignored;
+        out += visible_slice(sides[side]->get_line(idx[side]), 0, half - 2,
+                             vector<attr_run>(), ignored, sides[side]);
+        spans.push_back({0, !d.changed ? hl_plain : (side == 0 ? hl_error : hl_string)});
+        this->buffer_window->display_runs(row, side == 0 ? 0 : half + 1, out, spans);
+      }
+      this->buffer_window->display_line(row, half, "|");
+    }
   }
 
-  string mode_read_input(const string & prompt) {
-    string input =  this->mode_window->read_input(prompt);
-    this->mode_window->display_line(0,0,input);
-    return input;
+  /**
+   * Scroll a compressed buffer by rows, or to its last page (as far as
+   * it has been read) when rows is 0.
+   */
+  void scroll_compressed(long rows) {
+    buf* buffer = this->get_current_buffer();
+    gz_reader* gz = buffer->get_compressed();
+    long last = max(0L, long(gz->line_count()) - view_height());
+    gz_top = rows ? max(0L, min(last, long(gz_top) + rows)) : last;
+    compressed_status();
+    mark_redisplay();
   }
 
-  buf* get_current_buffer() {
-    return this->buffers->get_current_buffer();
+  void compressed_status() {
+    buf* buffer = this->get_current_buffer();
+    gz_reader* gz = buffer->get_compressed();
+    string status = "line " + to_string(gz_top + 1) + " of " + to_string(gz->line_count());
+    if(!gz->get_error().empty()) {
+      status += ", " + gz->get_error();
+    } else if(!gz->finished()) {
+      status += ", reading " + to_string(gz->percent()) + "%";
+    }
+    buffer->set_status(status);
   }
 
-  void display_buffer() {
-    //app::get_logger().log("display_buffer");
+  void display_compressed() {
+    buf* buffer = this->get_current_buffer();
+    vector<string> rows;
+    buffer->get_compressed()->get_lines(gz_top, view_height(), gz_row_bytes, rows);
+    for(size_t row = 0 ; row < rows.size() ; row++) {
+      if(line_number_show) {
+        char ls[256];
+        sprintf(ls,"%5d: ",int(gz_top + row));
+        this->buffer_window->display_line(row, 0, string(ls));
+      }
+      x_line line(0, 0, 0, rows[row].data(), rows[row].size());
+      vector<pair<size_t,int>> spans;
+      string out = visible_slice(&line, 0, text_width(), vector<attr_run>(), spans, buffer);
+      this->buffer_window->display_runs(row, gutter(), out, spans);
+    }
+  }
 
-    this->buffer_window->clear();
-    this->buffer_window->rewind();
+  /**
+   * Scroll the hex view by rows, to the last page when rows is 0.
+   */
+  void scroll_hex(long rows) {
+    hex_file* hex = this->get_current_buffer()->get_hex();
+    long last = max(0L, long(hex->rows()) - view_height());
+    hex_top = rows ? max(0L, min(last, long(hex_top) + rows)) : last;
+    hex_status("");
+    mark_redisplay();
+  }
 
-    buf* buffer =
-      this->buffers->get_current_buffer();
+  /**
+   * Show the row holding offset, given in hex (0x...) or decimal.
+   */
+  void goto_offset(const string& text) {
+    if(text.empty()) {
+      return;
+    }
+    hex_file* hex = this->get_current_buffer()->get_hex();
+    char* end;
+    uint64_t off = strtoull(text.c_str(), &end, 0);
+    if(*end || off >= max(size_t(1), hex->size())) {
+      hex_status("no offset " + text);
+      return;
+    }
+    hex_top = off / hex_file::row_bytes;
+    scroll_hex(-min(long(hex_top), long(view_height() / 2)));
+  }
 
-    vector<x_line*> & lines = buffer->get_lines();
+  /**
+   * Find the bytes text stands for (see hex_file::parse_pattern) after
+   * the last ones found, or from the top of the view.
+   */
+  void search_hex(const string& text) {
+    if(!text.empty()) {
+      hex_pattern = text;
+    }
+    string bytes;
+    if(!hex_file::parse_pattern(hex_pattern, bytes)) {
+      hex_status("not hex digits or \"text\": " + hex_pattern);
+      return;
+    }
+    hex_file* hex = this->get_current_buffer()->get_hex();
+    uint64_t from = hex_found_len ? hex_found + 1 : uint64_t(hex_top) * hex_file::row_bytes;
+    uint64_t at;
+    bool cancelled = false;
+    auto progress = [&](int percent) {
+      if(headless()) {
+        return true;
+      }
+      hex_status("searching " + to_string(percent) + "%, ^g cancels");
+      display_mode_line();
+      nodelay(stdscr, TRUE);
+      int c = getch();
+      timeout(poll_interval);
+      cancelled = (c == ('g' & 0x1f) || c == 27);
+      if(c != ERR && !cancelled) {
+        ungetch(c);
+      }
+      return !cancelled;
+    };
+    if(!hex->find(bytes, from, at, progress)) {
+      hex_found_len = 0;
+      hex_status(cancelled ? "search cancelled" : "not found: " + hex_pattern);
+      mark_redisplay();
+      return;
+    }
+    hex_found = at;
+    hex_found_len = bytes.size();
+    hex_top = at / hex_file::row_bytes;
+    scroll_hex(-min(long(hex_top), long(view_height() / 2)));
+  }
 
-    int line_count;
+  void hex_status(const string& note) {
+    buf* buffer = this->get_current_buffer();
+    hex_file* hex = buffer->get_hex();
+    char where[64];
+    snprintf(where, sizeof(where), "0x%llx of 0x%llx",
+             (unsigned long long)hex_top * hex_file::row_bytes,
+             (unsigned long long)hex->size());
+    string status = hex->get_error().empty() ? where : hex->get_error();
+    if(!note.empty()) {
+      status += ", " + note;
+    } else if(hex_found_len) {
+      snprintf(where, sizeof(where), ", found at 0x%llx", (unsigned long long)hex_found);
+      status += where;
+    }
+    buffer->set_status(status);
+  }
 
-    for(auto line_ptr : lines) {
+  void end_hex() {
+    hex_found_len = 0;
+    this->get_current_buffer()->set_status("");
+    mark_redisplay();
+  }
 
-      if((line_count - start_line) >=
-         this->buffer_window->get_height()) {
-        break;
+  /**
+   * Rows of the hex view, the bytes last found highlighted.
+   */
+  void display_hex() {
+    hex_file* hex = this->get_current_buffer()->get_hex();
+    for(int row = 0 ; row < view_height() && hex_top + row < hex->rows() ; row++) {
+      string out = hex->format_row(hex_top + row);
+      vector<pair<size_t,int>> spans {{0, hl_plain}};
+      uint64_t first = uint64_t(hex_top + row) * hex_file::row_bytes;
+      uint64_t from = max(first, hex_found);
+      uint64_t to = min(first + hex_file::row_bytes, hex_found + hex_found_len);
+      if(hex_found_len && from < to) {
+        int a = from - first, b = to - first - 1;
+        spans = {{0, hl_plain},
+                 {size_t(hex->hex_column(a)), hl_string},
+                 {size_t(hex->hex_column(b) + 2), hl_plain},
+                 {size_t(hex->ascii_column(a)), hl_string},
+                 {size_t(hex->ascii_column(b) + 1), hl_plain}};
       }
+      this->buffer_window->display_runs(row, 0, out, spans);
+    }
+  }
 
-      if(line_count < start_line) {
-        line_count++;
-        continue;
-      }
+  /**
+   * Keep where the point is in the current buffer for when it is
+   * shown again.
+   */
+  void save_view() {
+    buf* current = this->get_current_buffer();
+    if(!current) {
+      return;
+    }
+    buf::view& v = current->last_view;
+    v.cursor = this->cursor;
+    v.start_line = this->start_line;
+    v.start_col = this->start_col;
+    v.start_row = this->start_row;
+    v.gz_top = this->gz_top;
+    v.hex_top = this->hex_top;
+  }
 
-      // iterate through the lines going to cursor poistion
-      if(line_number_show){
-        char ls[256];
-        sprintf(ls,"%5d: ",line_count);
-        this->buffer_window->display_line(string(ls));
+  /**
+   * Put the point where it was left in the current buffer.
+   */
+  void restore_view() {
+    const buf::view& v = this->get_current_buffer()->last_view;
+    this->cursor = v.cursor;
+    this->start_line = v.start_line;
+    this->start_col = v.start_col;
+    this->start_row = v.start_row;
+    this->gz_top = v.gz_top;
+    this->hex_top = v.hex_top;
+    this->hex_found_len = 0;
+    mark_redisplay();
+  }
 
-        this->buffer_window->display_line(line_ptr->gap_data.gap_info());
-      }
+  /**
+   * Make buffer current with the point where it was left.
+   */
+  void show_buffer(buf* buffer) {
+    save_view();
+    this->buffers->set_current(buffer);
+    restore_view();
+  }
+
+  /**
+   * Make buffer the current one with the point on line idx.
+   */
+  void switch_buffer(buf* buffer, size_t idx) {
+    save_view();
+    this->buffers->set_current(buffer);
+    this->gz_top = 0;
+    this->hex_top = 0;
+    this->hex_found_len = 0;
+    this->start_line = 0;
+    this->start_col = 0;
+    this->start_row = 0;
+    this->cursor = make_point(0, 0);
+    goto_line(idx);
+    mark_redisplay();
+  }
 
-      this->buffer_window->display_line(line_ptr->data);
-      this->buffer_window->display_line("\n");
-      line_count++;
+  void next_buffer() {
+    const vector<buf*>& all = this->buffers->get_buffers();
+    auto it = find(all.begin(), all.end(), this->get_current_buffer());
+    if(it != all.end() && all.size() > 1) {
+      show_buffer(++it == all.end() ? all.front() : *it);
     }
-    // rewind to beginning -
-    this->buffer_window->rewind();
   }
 
   /**
-   * box value withing limits with included
-   * padding.
+   * Find pattern in every buffer, list the matching lines in the
+   * *search* buffer, buffers with the most matches first.
    */
-  int box(int value,
-          pair<int,int>  limits,
-          pair<int,int>  padding) {
-
-    int min = limits.first  - padding.first;
-    int max = limits.second - padding.second;
+  void search_all(const string& pattern) {
+    if(pattern.empty()) {
+      return;
+    }
+    struct found {
+      buf* buffer;
+      size_t count;
+      vector<size_t> lines;
+    };
+    vector<found> all;
+    size_t total = 0;
+    for(auto b : this->buffers->get_buffers()) {
+      if(b == results) {
+        continue;
+      }
+      found f {b, 0, {}};
+      f.count = b->find_lines(pattern, f.lines, max_hits);
+      total += f.count;
+      if(f.count) {
+        all.push_back(std::move(f));
+      }
+    }
+    stable_sort(all.begin(), all.end(),
+                [](const found& x, const found& y) { return x.count > y.count; });
 
-    if(value  >= max)
-      return max;
-    else if(value <= min) {
-      return min;
-    } else {
-      return value;
+    if(!results) {
+      results = new buf("*search*", "");
+      append_buffer(results);
+    }
+    vector<x_line*> text;
+    result_hits.clear();
+    auto add = [&](const string& line, buf* b, size_t idx) {
+      text.push_back(results->make_line(line.data(), line.size()));
+      result_hits.push_back({b, idx});
+    };
+    char mb[32];
+    snprintf(mb, sizeof(mb), "%.1fMB", trigram_index::memory_used() / 1e6);
+    add("search " + pattern + ": " + to_string(total) + " lines in " +
+        to_string(all.size()) + " buffers, index " + mb, NULL, 0);
+    for(auto& f : all) {
+      add(f.buffer->get_buffer_name() + ": " + to_string(f.count) + " lines", NULL, 0);
+      for(auto idx : f.lines) {
+        x_line* line = f.buffer->get_line(idx);
+        add(to_string(idx + 1) + ": " +
+            string(line->data(), min(line->size(), 512)), f.buffer, idx);
+      }
     }
+    results->replace_lines(0, results->get_lines().size(), text);
+    switch_buffer(results, 0);
+    results->set_status(to_string(total) + " lines, enter jumps to one");
   }
 
-  point make_point(int y, int x){
-    return make_pair(y,x);
+  /**
+   * On a line of the search results, go to the line it lists.
+   */
+  void follow_result() {
+    if(this->get_current_buffer() != results) {
+      return;
+    }
+    size_t idx = get_currrent_line_idx();
+    const vector<buf*>& all = this->buffers->get_buffers();
+    if(idx < result_hits.size() && result_hits[idx].first &&
+       find(all.begin(), all.end(), result_hits[idx].first) != all.end()) {
+      switch_buffer(result_hits[idx].first, result_hits[idx].second);
+    }
   }
 
-  point bol() {
-    return make_pair(cursor.first,0);
+  /**
+   * Answers for the prompts of the commands run next.
+   */
+  void feed_input(const vector<string>& answers) {
+    script_input.insert(script_input.end(), answers.begin(), answers.end());
   }
 
-  point bof() {
-    return make_pair(0,0);
+  /**
+   * Drop answers the commands run did not ask for, so they do not go
+   * to the prompts of the next ones.
+   */
+  void drop_input() {
+    script_input.clear();
   }
 
-  point eof() {
-    return make_pair(this->get_current_buffer()->get_lines().size(),0);
+  /**
+   * Take buffer off the editor, the point goes back to the top.
+   */
+  void close_buffer(buf* buffer) {
+    this->buffers->remove(buffer);
+    this->start_line = 0;
+    this->start_col = 0;
+    this->start_row = 0;
+    this->cursor = make_point(0, 0);
+    this->mode = command_mode;
   }
 
-  point eol() {
-    return make_pair(cursor.first, get_line_size());
+  /**
+   * Put the point at the start of line idx, clamped to the buffer.
+   */
+  void goto_line(size_t idx) {
+    size_t count = this->get_current_buffer()->get_lines().size();
+    set_point(count ? min(idx, count - 1) : 0, 0);
+    mark_redisplay();
   }
 
-  int get_line_size(size_t idx) {
-    if(idx >= 0 &&
-       idx < this->get_current_buffer()->get_lines().size()) {
-
-      x_line* cur = (this->get_current_buffer()->get_lines())[idx];
+  /**
+   * Move the point to the next occurrence of pattern after it, going
+   * round to the top of the buffer once.
+   */
+  void search_forward(const string& pattern) {
+    if(pattern.empty()) {
+      return;
+    }
+    last_search = pattern;
+    buf* buffer = this->get_current_buffer();
+    size_t idx;
+    int byte, col;
+    if(!point_position(idx, byte, col)) {
+      buffer->set_status("not found: " + pattern);
+      return;
+    }
 
-      if(cur) {
-        return cur->size() - 1;
+    size_t count = buffer->get_lines().size();
+    for(size_t n = 0 ; n <= count ; n++) {
+      size_t i = (idx + n) % count;
+      x_line* line = buffer->get_line(i);
+      int from = (n == 0) ? min(byte + 1, line->size()) : 0;
+      const char* hit = static_cast<const char*>(
+          memmem(line->data() + from, line->size() - from,
+                 pattern.data(), pattern.size()));
+      if(hit && (n < count || hit - line->data() <= byte)) {
+        int at = hit - line->data();
+        set_point(i, col_index::width(line->data(), at, line->get_text_type()));
+        buffer->set_status(i < idx ? "search wrapped" : "");
+        mark_redisplay();
+        return;
       }
     }
-    return 0;
+    buffer->set_status("not found: " + pattern);
   }
 
-  int get_line_size() {
-    x_line* cur = this->get_current_line();
-    if(cur) {
-      return cur->size() - 1;
-    }
-    return 0;
+  void search_next() {
+    search_forward(last_search);
   }
 
-  point inc_point(point p, int inc, move_dir dir)
-  {
-    if(dir == move_y) {
-      return make_point(box(p.first+inc,
-                            {0, this->buffer_window->get_height()},
-                            {0, this->mode_padding})
-                        ,min(this->get_line_size(p.first+inc)+1 ,p.second));
-    } else if(dir == move_x) { // need to compute size of incremented line
-      return make_point(p.first,
-                        box(p.second + inc,
-                            {0, min(this->get_line_size(p.first)+1,
-                                    this->buffer_window->get_width())},
-                            {0, this->mode_padding}));
-    } else{
-      return cursor;
+  /**
+   * Replace every occurrence of from in the buffer, showing progress
+   * in the mode window; ^g or escape cancels before anything changes.
+   * All lines change as one edit.
+   */
+  void replace_all(const string& from, const string& to) {
+    buf* buffer = this->get_current_buffer();
+    if(from.empty()) {
+      buffer->set_status("replace: empty pattern");
+      return;
+    }
+    replace_job job(buffer->get_lines(), from, to);
+    vector<int> typed;  // keys for after the replace
+    if(headless()) {
+      job.wait();
+    }
+    while(!job.finished()) {
+      buffer->set_status("replacing " + to_string(job.percent()) + "%, " +
+                         to_string(job.matches()) + " matches, ^g cancels");
+      display_mode_line();
+      int c = getch();  // waits poll_interval at most
+      if(c == ('g' & 0x1f) || c == 27) {
+        job.cancel();
+      } else if(c != ERR) {
+        typed.push_back(c);
+      }
+    }
+    for(auto it = typed.rbegin() ; it != typed.rend() ; it++) {
+      ungetch(*it);
     }
-  }
 
-  void move_point(int inc, move_dir dir, anchor_type anchor ) {
-    // compute increment relative to anchor
-    if(anchor == no_anchor) {
-      this->cursor = inc_point(cursor,inc,dir);
-    } else if (anchor == line_begin) {
-      this->cursor = inc_point(bol(),inc, editor::move_x);
-    } else if (anchor == line_end) {
-      this->cursor = inc_point(eol(),inc, editor::move_x);
-    } else if (anchor == file_begin) {
-      this->cursor = inc_point(bof(),inc,editor::move_y);
-    } else if (anchor == file_end) {
-      this->cursor = inc_point(eof(),inc,editor::move_y);
+    if(job.was_cancelled()) {
+      buffer->set_status("replace cancelled");
+      display_mode_line();
+      return;
     }
 
-    else  {
+    vector<size_t> at;
+    vector<x_line*> added;
+    line_arena arena;
+    job.take(at, added, arena);
+    buffer->adopt(arena);
+    buffer->set_lines(at, added, from, to);
+    buffer->set_status("replaced " + to_string(job.matches()) + " on " +
+                       to_string(at.size()) + " lines");
+    mark_redisplay();
+  }
+
+  /**
+   * Sort, uniq, keep or drop lines as spec says (see line_filter), as
+   * one edit.
+   */
+  void filter_lines(const string& spec) {
+    if(spec.empty()) {
       return;
     }
+    buf* buffer = this->get_current_buffer();
+    line_filter filter;
+    string error;
+    size_t begin, end;
+    if(!filter.parse(spec, error)) {
+      buffer->set_status(error);
+    } else if(!filter.range(buffer->get_lines().size(), begin, end)) {
+      buffer->set_status("no such lines: " + spec);
+    } else {
+      const vector<x_line*>& lines = buffer->get_lines();
+      vector<x_line*> in(lines.begin() + begin, lines.begin() + end);
+      vector<x_line*> out;
+      line_arena arena;
+      filter.run(in, out, arena);
+      if(out != in) {
+        buffer->adopt(arena);
+        buffer->replace_lines(begin, in.size(), out);
+        goto_line(begin);
+      }
+      buffer->set_status(to_string(in.size()) + " lines in, " +
+                         to_string(out.size()) + " out");
+    }
+    mark_redisplay();
   }
 
-  void move_page(int pg_inc) {
-    int max_lines =
-      this->get_current_buffer()->get_lines().size();
+  /**
+   * Undo (or redo) the last group of edits and put the point where it
+   * happened.
+   */
+  void undo(bool redo) {
+    buf* buffer = this->get_current_buffer();
+    pair<size_t,int> where;
+    if(!(redo ? buffer->redo(where) : buffer->undo(where))) {
+      return;
+    }
+    if(buffer->get_lines().empty()) {
+      this->start_line = 0;
+      this->cursor = make_point(0, 0);
+    } else {
+      size_t idx = min(where.first, buffer->get_lines().size() - 1);
+      x_line* line = buffer->get_line(idx);
+      int byte = min(where.second, line->size());
+      set_point(idx, col_index::width(line->data(), byte, line->get_text_type()));
+    }
+    mark_redisplay();
+  }
 
-    int pg_size =
-      this->buffer_window->get_height();
+  /**
+   * Drop every edit to the current buffer, recovered ones included.
+   */
+  void revert() {
+    buf* buffer = this->get_current_buffer();
+    if(!buffer->revert()) {
+      buffer->set_status("revert: file changed since it was read");
+    }
+    goto_line(get_currrent_line_idx());
+    mark_redisplay();
+  }
 
-    int new_start_line =
-      this->start_line + (pg_inc * screen_height);
+  void newline_at_point() {
+    size_t idx;
+    int byte, col;
+    first_line();
+    point_position(idx, byte, col);
+    this->get_current_buffer()->split_line(idx, byte);
+    set_point(idx + 1, 0);
+    mark_redisplay();
+  }
 
-    if(new_start_line <= 0 ) {
-      this->start_line = 0;
-    } else if(new_start_line >= max_lines){
-      this->start_line = max_lines - pg_size;
-    }  else {
-      this->start_line = new_start_line;
+  /**
+   * Delete the character before the point, joining lines at the start
+   * of one.
+   */
+  void delete_before_point() {
+    buf* buffer = this->get_current_buffer();
+    size_t idx;
+    int byte, col;
+    x_line* line = point_position(idx, byte, col);
+    if(!line) {
+      return;
     }
 
+    if(col > 0) {
+      int prev_col;
+      int prev = column_byte(line, col - 1, prev_col);
+      buffer->erase_text(idx, prev, byte - prev);
+      set_point(idx, prev_col);
+    } else if(idx > 0) {
+      int prev_col = get_line_columns(buffer->get_line(idx - 1));
+      buffer->join_line(idx - 1);
+      set_point(idx - 1, prev_col);
+    }
     mark_redisplay();
   }
 
-  void mark_redisplay() {
-    this->redisplay = true;
+  /**
+   * Switch soft wrap, keeping the current line at the top of the view.
+   */
+  void toggle_wrap() {
+    this->start_line = get_currrent_line_idx();
+    this->soft_wrap = !this->soft_wrap;
+    this->start_row = 0;
+    this->start_col = 0;
+    this->cursor = make_point(0, 0);
   }
 
   const string parse_cmd() {
-    char cur = getch();
+    int key = getch();
+    if(key == ERR) { // timed out, no command
+      return "";
+    }
+    char cur = key;
     string c(1,cur);
 
+    // keep multibyte characters in one piece
+    if((key & 0xC0) == 0xC0) {
+      int more = (key >= 0xF0) ? 3 : (key >= 0xE0) ? 2 : 1;
+      while(more-- > 0 && (key = getch()) != ERR) {
+        c += char(key);
+      }
+      return c;
+    }
+
     vector<char> alphabet;
     char start = 'a';
     while(start < 'z')
@@ -925,8 +7246,22 @@ public:
 
   void start() {
     this->init();
+    startup_trace::mark("initscr");
     this->quit = false;
 
+    // first frame from the first screenful of the first file
+    if(!startup_files.empty()) {
+      open_buffer(startup_files[0], startup_files[0], screen_height);
+      startup_trace::mark("read first screen");
+    }
+    this->change_mode(command_mode);
+    this->display_mode_line();
+    this->display_buffer();
+    this->display_cursor();
+    startup_trace::mark("first paint");
+
+    this->finish_startup();
+
     while(!this->quit) { // quit
       noecho();
 
@@ -941,12 +7276,14 @@ public:
 
       // trigger command
       this->run_cmd(this->parse_cmd());
+      this->poll_background();
 
       // run the next command till redisplay becomes necessary
       while(!this->redisplay
             && !this->quit) {
         // get-input
         this->run_cmd(this->parse_cmd());
+        this->poll_background();
 
         // move the window to current place
         this->display_cursor();
@@ -959,8 +7296,62 @@ public:
     return;
   }
 
+  /**
+   * Files start() opens, the first one shown.
+   */
+  void add_startup_file(const string& path) {
+    startup_files.push_back(path);
+  }
+
+  /**
+   * What startup put off until the first frame was up: the rest of the
+   * first file, the other files, the keymaps and the log file.
+   */
+  void finish_startup() {
+    buf* first = this->get_current_buffer();
+    first->finish_fill();
+    startup_trace::mark("read first file");
+
+    for(size_t i = 1 ; i < startup_files.size() ; i++) {
+      open_buffer(startup_files[i], startup_files[i]);
+    }
+    if(startup_files.size() > 1) {
+      show_buffer(first);
+    }
+    startup_trace::mark("open other files");
+
+    this->build_modes();
+    this->change_mode(command_mode);
+    startup_trace::mark("keymaps");
+
+    app::get_logger().open();
+    app::get_logger().log("x: first paint after " +
+                          to_string(startup_trace::at("first paint")) + " ms");
+    startup_trace::mark("log file");
+    mark_redisplay();
+  }
+
+  /**
+   * Redisplay when work running off the main thread has something new
+   * to show.
+   */
+  void poll_background() {
+    buf* buffer = this->get_current_buffer();
+    if(buffer->highlight_updated()) {
+      mark_redisplay();
+    }
+    if(buffer->get_compressed() && buffer->get_compressed()->updated()) {
+      compressed_status();
+      mark_redisplay();
+    }
+    if(buffer->poll_save()) {
+      display_mode_line();
+      display_cursor();
+    }
+  }
+
   void display_cursor(){
-    move(this->cursor.first, this->cursor.second);
+    move(this->cursor.first, this->gutter() + this->cursor.second);
     refresh(); // refresh to see cursor.
   }
 
@@ -973,8 +7364,24 @@ public:
     this->buffers->append(buffer);
   }
 
+  /**
+   * Open path in a new buffer and show it, see buf_list::open.
+   */
+  buf* open_buffer(const string& name, const string& path, size_t head = 0) {
+    save_view();
+    buf* buffer = this->buffers->open(name, path, head);
+    restore_view();
+    return buffer;
+  }
+
+  void set_current_buffer(buf* buffer) {
+    this->buffers->set_current(buffer);
+  }
+
   ~editor(){
-    endwin();
+    if(!headless()) {
+      endwin();
+    }
     // display manages buffers and its windows.
     delete buffers;
     delete mode_window;
@@ -1001,6 +7408,14 @@ editor_mode mv_point::operator()(editor& d, const string &cmd) {
     d.move_point(0,editor::move_x, editor::line_end);
   } else if (cmd == "G") {
     d.move_point(0,editor::move_y, editor::file_end);
+  } else if (cmd == "L") {
+    d.scroll_columns(d.text_width() / 2);
+  } else if (cmd == "H") {
+    d.scroll_columns(-d.text_width() / 2);
+  } else if (cmd == "|") {
+    string column = d.mode_read_input(string("Column:"));
+    d.goto_column(atoi(column.c_str()));
+    d.mark_redisplay();
   }
 
   return command_mode;
@@ -1021,51 +7436,486 @@ editor_mode toggle::operator()(editor & d, const string& cmd) {
       d.line_number_show = false;
     else
       d.line_number_show = true;
+  } else if( cmd == "w" ) {
+    d.toggle_wrap();
+  }
+
+  d.mark_redisplay();
+  return command_mode;
+}
+
+editor_mode ins_mode::operator()(editor & d, const string& cmd) {
+  return insert_mode;
+}
+
+/**
+ * Keys typed in insert mode go into the buffer.
+ */
+editor_mode self_insert::operator()(editor & d, const string& cmd) {
+  if(cmd == "\x1b") {
+    d.mark_redisplay();
+    return command_mode;
+  } else if(cmd == "^m" || cmd == "^j") {
+    d.newline_at_point();
+  } else if(cmd == "^h" || cmd == "\x7f") {
+    d.delete_before_point();
+  } else if(cmd == "^i") {
+    d.insert_at_point("\t");
+  } else if(cmd.size() > 1 && cmd[0] == '^') { // other control keys do nothing
+  } else {
+    d.insert_at_point(cmd);
   }
+  return insert_mode;
+}
 
+editor_mode save_buf::operator()(editor & d, const string& cmd) {
+  d.get_current_buffer()->save();
   d.mark_redisplay();
   return command_mode;
 }
 
+editor_mode filter_cmd::operator()(editor & d, const string& cmd) {
+  d.filter_lines(d.mode_read_input(string("Filter lines:")));
+  return command_mode;
+}
+
+editor_mode buffers_cmd::operator()(editor & d, const string& cmd) {
+  if(cmd == "A") {
+    d.search_all(d.mode_read_input(string("Search all buffers:")));
+  } else if(cmd == "B") {
+    d.next_buffer();
+  } else if(cmd == "^m" || cmd == "^j") {
+    d.follow_result();
+  }
+  return command_mode;
+}
+
+editor_mode diff_cmd::operator()(editor & d, const string& cmd) {
+  if(cmd == "D") {
+    string name = d.mode_read_input(string("Diff against buffer:"));
+    return d.start_diff(name) ? diff_mode : command_mode;
+  } else if(cmd == "j" || cmd == "^n") {
+    d.scroll_diff(1);
+  } else if(cmd == "k" || cmd == "^p") {
+    d.scroll_diff(-1);
+  } else if(cmd == " " || cmd == ">" || cmd == "^v") {
+    d.scroll_diff(d.view_height());
+  } else if(cmd == "<") {
+    d.scroll_diff(-d.view_height());
+  } else if(cmd == "n") {
+    d.next_hunk(1);
+  } else if(cmd == "N") {
+    d.next_hunk(-1);
+  } else if(cmd == "\x1b") {
+    d.end_diff();
+    return command_mode;
+  }
+  return diff_mode;
+}
+
+editor_mode hex_cmd::operator()(editor & d, const string& cmd) {
+  if(cmd == "X") {
+    d.mark_redisplay();
+  } else if(cmd == "j" || cmd == "^n") {
+    d.scroll_hex(1);
+  } else if(cmd == "k" || cmd == "^p") {
+    d.scroll_hex(-1);
+  } else if(cmd == " " || cmd == ">" || cmd == "^v") {
+    d.scroll_hex(d.view_height());
+  } else if(cmd == "<") {
+    d.scroll_hex(-d.view_height());
+  } else if(cmd == "G") {
+    d.scroll_hex(0);
+  } else if(cmd == "g") {
+    d.goto_offset(d.mode_read_input(string("Offset:")));
+  } else if(cmd == "/") {
+    d.search_hex(d.mode_read_input(string("Find bytes:")));
+  } else if(cmd == "n") {
+    d.search_hex("");
+  } else if(cmd == "B") {
+    d.next_buffer();
+    return command_mode;
+  } else if(cmd == "\x1b") {
+    d.end_hex();
+    return command_mode;
+  }
+  return hex_mode;
+}
+
+editor_mode gz_cmd::operator()(editor & d, const string& cmd) {
+  if(cmd == "j" || cmd == "^n") {
+    d.scroll_compressed(1);
+  } else if(cmd == "k" || cmd == "^p") {
+    d.scroll_compressed(-1);
+  } else if(cmd == " " || cmd == ">" || cmd == "^v") {
+    d.scroll_compressed(d.view_height());
+  } else if(cmd == "<") {
+    d.scroll_compressed(-d.view_height());
+  } else if(cmd == "G") {
+    d.scroll_compressed(0);
+  } else if(cmd == "B") {
+    d.next_buffer();
+  }
+  return command_mode;
+}
+
+editor_mode undo_cmd::operator()(editor & d, const string& cmd) {
+  if(cmd == "R") {
+    d.revert();
+  } else {
+    d.undo(cmd == "^r");
+  }
+  return command_mode;
+}
+
 editor_mode search_fwd::operator()(editor & d, const string& cmd) {
-  if( cmd == "/" ) {
+  if( cmd == "/" || cmd == "^s" ) {
     string search_string  = d.mode_read_input(string("Search Forward :"));
+    d.search_forward(search_string);
     d.mark_redisplay();
   } else if (cmd == "n") {
+    d.search_next();
+  } else if (cmd == "%") {
+    string from = d.mode_read_input(string("Replace :"));
+    string to = from.empty() ? "" : d.mode_read_input(string("Replace " + from + " with :"));
+    d.replace_all(from, to);
+    d.mark_redisplay();
   }
-  return search_mode;
+  return command_mode;
 }
 
 editor_mode open_file::operator()(editor & d, const string& cmd) {
   if( cmd == "o" ) {
     string file_path  = d.mode_read_input(string("File:"));
-    buf* new_buf  = new buf(file_path,file_path);
-    d.append_buffer(new_buf);
+    d.open_buffer(file_path, file_path);
 
     d.mark_redisplay();
   }
   return command_mode;
 }
 
+/**
+ * Headless batch mode, x -s script [file...]: runs an ex-style script
+ * on every file through the same keymaps as the terminal does, on an
+ * editor without windows. One command per script line:
+ *
+ *   /pattern        search forward
+ *   s/from/to/      replace everywhere, any delimiter
+ *   i text          insert text at the point
+ *   sort, uniq, keep, drop   filter lines, see line_filter
+ *   N               go to line N
+ *   normal keys     command mode keys, ^x for control keys
+ *   p               print file:line:text of the current line
+ *   =               print file:line of the current line
+ *   w               save
+ *   # ...           comment
+ *
+ * Files go to one worker per core, each file's output is written as
+ * soon as it is through. Throughput goes to stderr at the end.
+ */
+class batch {
+public:
+  struct step {
+    enum kind { keys, line, print, number } type = keys;
+    vector<string> cmds;   // keys run one after the other
+    vector<string> input;  // answers to their prompts
+    size_t line_idx = 0;   // for line
+  };
+
+private:
+  const static int rows = 24;  // screen the commands believe they have
+  const static int cols = 80;
+
+  vector<step> steps;
+
+  mutex out_lock;
+  atomic<size_t> next_file;
+  atomic<size_t> failed;
+  atomic<uint64_t> total_bytes;
+
+  // files written back, under out_lock: synced once all are through.
+  vector<string> saved;
+
+  /**
+   * Keys spelled out in text, "^x" being one when controls is set.
+   */
+  static vector<string> split_keys(const string& text, bool controls) {
+    vector<string> keys;
+    for(size_t i = 0 ; i < text.size() ; ) {
+      if(controls && text[i] == '^' && i + 1 < text.size()) {
+        keys.push_back(text.substr(i, 2));
+        i += 2;
+        continue;
+      }
+      int n = utf8::sequence_length(
+          reinterpret_cast<const unsigned char*>(text.data() + i), text.size() - i);
+      n = max(n, 1);
+      keys.push_back(text.substr(i, n));
+      i += n;
+    }
+    return keys;
+  }
+
+  /**
+   * Step for script line, false with error set when it is not a
+   * command.
+   */
+  static bool parse_line(const string& line, step& st, string& error) {
+    string not_filter;
+    if(line[0] == '/') {
+      st.cmds = {"/"};
+      st.input = {line.substr(1)};
+    } else if(line_filter().parse(line, not_filter)) {
+      st.cmds = {"!"};
+      st.input = {line};
+    } else if(line[0] == 's' && line.size() > 1) {
+      char delim = line[1];
+      size_t mid = line.find(delim, 2);
+      if(mid == string::npos) {
+        return false;
+      }
+      if(mid == 2) {
+        error = "empty pattern: " + line;
+        return false;
+      }
+      size_t end = line.find(delim, mid + 1);
+      st.cmds = {"%"};
+      st.input = {line.substr(2, mid - 2),
+                  line.substr(mid + 1, end == string::npos ? string::npos
+                                                           : end - mid - 1)};
+    } else if(line.compare(0, 2, "i ") == 0) {
+      st.cmds = split_keys(line.substr(2), false);
+      st.cmds.insert(st.cmds.begin(), "i");
+      st.cmds.push_back("\x1b");
+    } else if(line.find_first_not_of("0123456789") == string::npos) {
+      st.type = step::line;
+      st.line_idx = max(1L, atol(line.c_str())) - 1;
+    } else if(line.compare(0, 7, "normal ") == 0) {
+      st.cmds = split_keys(line.substr(7), true);
+    } else if(line == "p") {
+      st.type = step::print;
+    } else if(line == "=") {
+      st.type = step::number;
+    } else if(line == "w") {
+      st.cmds = {"W"};
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Run the script on path, output goes to out, complaints to err.
+   */
+  bool run_file(editor& ed, const string& path, string& out, string& err,
+                bool& wrote) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      err += "x: " + path + ": cannot open\n";
+      return false;
+    }
+    total_bytes += st.st_size;
+
+    buf* buffer = new buf(path, path);
+    ed.append_buffer(buffer);
+    for(auto& s : steps) {
+      if(s.type == step::keys) {
+        ed.feed_input(s.input);
+        for(auto& c : s.cmds) {
+          ed.run_cmd(c);
+        }
+        ed.drop_input();
+        continue;
+      }
+      if(s.type == step::line) {
+        ed.goto_line(s.line_idx);
+        continue;
+      }
+      size_t idx = ed.get_currrent_line_idx();
+      out += path + ":" + to_string(idx + 1);
+      x_line* line = buffer->get_line(idx);
+      if(s.type == step::print && line) {
+        out += ":";
+        out.append(line->data(), line->size());
+      }
+      out += "\n";
+    }
+    buf::save_outcome saved = buffer->wait_save();
+    wrote = saved == buf::save_ok;
+    bool ok = saved != buf::save_error;
+    if(!ok) {
+      err += "x: " + path + ": " + buffer->get_status() + "\n";
+    }
+    ed.close_buffer(buffer);
+    delete buffer;
+    return ok;
+  }
+
+  void work(const vector<string>& files) {
+    editor ed;
+    ed.init_headless(rows, cols);
+    for(size_t i ; (i = next_file++) < files.size() ; ) {
+      string out, err;
+      bool wrote = false;
+      if(!run_file(ed, files[i], out, err, wrote)) {
+        failed++;
+      }
+      lock_guard<mutex> l(out_lock);
+      if(wrote) {
+        saved.push_back(files[i]);
+      }
+      cout << out << flush;
+      cerr << err;
+    }
+  }
+
+  /**
+   * fsync every one of paths, on up to n threads.
+   */
+  static void fsync_all(const vector<string>& paths, size_t n) {
+    atomic<size_t> next(0);
+    auto flush = [&]() {
+      for(size_t i ; (i = next++) < paths.size() ; ) {
+        int fd = open(paths[i].c_str(), O_RDONLY);
+        if(fd >= 0) {
+          fsync(fd);
+          close(fd);
+        }
+      }
+    };
+    vector<thread> workers;
+    for(size_t i = 0 ; i < min(n, paths.size()) ; i++) {
+      workers.push_back(thread(flush));
+    }
+    for(auto& w : workers) {
+      w.join();
+    }
+  }
+
+  /**
+   * Make the saves durable: the files written, then the directories
+   * the renames went into. Nothing to do when nothing was saved.
+   */
+  void sync_saved(size_t n) {
+    std::set<string> dirs;
+    for(auto& path : saved) {
+      size_t slash = path.rfind('/');
+      dirs.insert(slash == string::npos ? "." : path.substr(0, slash + 1));
+    }
+    fsync_all(saved, n);
+    fsync_all(vector<string>(dirs.begin(), dirs.end()), n);
+  }
+
+public:
+  batch(): next_file(0), failed(0), total_bytes(0) {}
+
+  /**
+   * Read the script, false with error set on a line that is not a
+   * command.
+   */
+  bool parse(istream& in, string& error) {
+    string line;
+    for(int n = 1 ; getline(in, line) ; n++) {
+      if(line.empty() || line[0] == '#') {
+        continue;
+      }
+      step st;
+      string why;
+      if(!parse_line(line, st, why)) {
+        error = "line " + to_string(n) + ": " +
+          (why.empty() ? "unknown command: " + line : why);
+        return false;
+      }
+      steps.push_back(st);
+    }
+    return true;
+  }
+
+  /**
+   * Run the script on files, returns the exit status.
+   */
+  int run(const vector<string>& files) {
+    app::headless = true;
+    app::debug_mode = false;
+    app::sync_saves = false;  // synced all at once at the end
+
+    auto begin = chrono::steady_clock::now();
+    size_t n = min(size_t(max(1u, thread::hardware_concurrency())), files.size());
+    vector<thread> workers;
+    for(size_t i = 0 ; i < n ; i++) {
+      workers.push_back(thread(&batch::work, this, std::cref(files)));
+    }
+    for(auto& w : workers) {
+      w.join();
+    }
+    sync_saved(n);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    secs = max(secs, 1e-6);
+
+    char report[256];
+    snprintf(report, sizeof(report),
+             "x: %zu files, %.1f MB in %.2fs: %.1f files/s, %.1f MB/s\n",
+             files.size(), total_bytes / 1e6, secs,
+             files.size() / secs, total_bytes / 1e6 / secs);
+    cerr << report;
+    return failed ? 1 : 0;
+  }
+};
+
 int
 main(int argc,char* argv[])
 {
+  startup_trace::mark("main");
   app a;
   //app::get_logger().log("x:started");
 
   editor editor;
-  string buffer_name("x.cc");
-  string file_path("/home/aakarsh/src/c/x/x.cc");
-
-  if(argc > 1) {     // add buffer to editor
-    buffer_name = argv[1];
-    file_path   = argv[1];
-  }else {
-    cout<<"Usage: x <filename>"<<endl;
+
+  // phases of startup to stderr on the way out
+  char** trace = find(argv + 1, argv + argc, string("--trace-startup"));
+  if(trace != argv + argc) {
+    startup_trace::enabled = true;
+    rotate(trace, trace + 1, argv + argc);
+    argc--;
+  }
+
+  if(getenv("X_UNDO_LIMIT")) {
+    app::undo_limit = strtoull(getenv("X_UNDO_LIMIT"), nullptr, 10);
+  }
+  if(getenv("X_INDEX_LIMIT")) {
+    app::index_limit = strtoull(getenv("X_INDEX_LIMIT"), nullptr, 10);
+  }
+
+  if(argc > 2 && string(argv[1]) == "-s") { // batch: script, then files
+    ifstream script(argv[2]);
+    batch run;
+    string error;
+    if(!script) {
+      cerr<<"x: cannot read "<<argv[2]<<endl;
+      return 2;
+    } else if(!run.parse(script, error)) {
+      cerr<<"x: "<<argv[2]<<": "<<error<<endl;
+      return 2;
+    }
+    vector<string> files(argv + 3, argv + argc);
+    if(files.empty()) { // file names on stdin
+      string path;
+      while(getline(cin, path)) {
+        files.push_back(path);
+      }
+    }
+    return run.run(files);
+  }
+
+  if(argc < 2) {
+    cout<<"Usage: x [--trace-startup] <filename> [filename...]"<<endl;
+    cout<<"       x -s <script> [file...]"<<endl;
     goto end;
   }
 
-  editor.append_buffer(new buf(buffer_name, file_path));
+  for(int i = 1; i < argc; i++) {   // the rest open behind the first
+    editor.add_startup_file(argv[i]);
+  }
   editor.start();
 
  end:
@@ -0,0 +1,72 @@
+/**
+ * Crash journal recovery: a journal left with a torn record at its end
+ * is replayed up to it, and edits made after the recovery must survive
+ * a second crash.
+ */
+#define main x_main
+#include "../src/x.cc"
+#undef main
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+  if(!ok) {
+    cerr << "FAIL: " << what << endl;
+    failures++;
+  }
+}
+
+int main() {
+  app::debug_mode = false;
+
+  char home[] = "/tmp/x-journal-test-XXXXXX";
+  if(!mkdtemp(home)) {
+    cerr << "mkdtemp failed" << endl;
+    return 1;
+  }
+  setenv("HOME", home, 1);
+
+  string path = string(home) + "/file.txt";
+  {
+    ofstream out(path);
+    out << "one\ntwo\n";
+  }
+  file_identity id;
+  check(id.read(path), "stat the file");
+  string journal_path = edit_journal::path_for(id);
+
+  // first crash: one whole record, then a torn one
+  {
+    edit_journal j(journal_path, id);
+    j.insert(0, 0, "A", 1);
+  }
+  {
+    ofstream out(journal_path, ios::binary | ios::app);
+    out << "\x20\x01\x02";
+  }
+
+  // recover, then edit on; the buffer is left alive, as a crash would
+  buf* b = new buf("file.txt", path);
+  check(b->get_status().find("recovered 1 edits") == 0,
+        "recovered the whole record, got: " + b->get_status());
+  check(b->get_line(0)->str() == "Aone", "first edit replayed");
+  b->insert_text(0, 1, "B", 1);
+  this_thread::sleep_for(chrono::milliseconds(600));  // a group commit
+
+  // second crash: both edits are in the journal
+  vector<edit_journal::record> records;
+  check(edit_journal::read(journal_path, id, records), "journal readable");
+  check(records.size() == 2, "two records after the second crash, got " +
+        to_string(records.size()));
+  check(records.size() == 2 && records[1].texts[0] == "B",
+        "edit after recovery kept");
+
+  unlink(journal_path.c_str());
+  unlink(path.c_str());
+  rmdir((string(home) + "/.x-journal").c_str());
+  rmdir(home);
+  if(!failures) {
+    cout << "journal_test: ok" << endl;
+  }
+  _exit(failures ? 1 : 0);
+}